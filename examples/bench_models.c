@@ -0,0 +1,125 @@
+/*
+  File: bench_models.c
+  Description: memory benchmark of the model tree. Registers 10k, 100k
+  and 1M models, each count in a fresh process, and reports the
+  resident set size they add, per model.
+  Version: $Id:$
+  License: LGPL v3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "avon.h"
+
+static uint64_t clock_get( void* obj ) { return 0; }
+static int pva_set( void* obj, av_pva_t* p ) { return 0; }
+static int geom_set( void* obj, av_geom_t* g ) { return 0; }
+
+static int pva_get( void* obj, av_pva_t* p )
+{
+	memset( p, 0, sizeof(*p) );
+	p->p[0] = (long)obj % 1000;
+	p->p[1] = (long)obj / 1000 % 1000;
+	return 0;
+}
+
+static int geom_get( void* obj, av_geom_t* g )
+{
+	memset( g, 0, sizeof(*g) );
+	g->extent[0] = g->extent[1] = 0.5;
+	return 0;
+}
+
+// resident set size in bytes, from /proc on Linux
+static size_t rss( void )
+{
+	size_t size = 0, resident = 0;
+	FILE* f = fopen( "/proc/self/statm", "r" );
+	if( f == NULL )
+		return 0;
+	if( fscanf( f, "%zu %zu", &size, &resident ) != 2 )
+		resident = 0;
+	fclose( f );
+	return resident * sysconf( _SC_PAGESIZE );
+}
+
+static double seconds( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* register [count] models, robots each with four parts below them, and
+	 report what they cost */
+static int run( size_t count )
+{
+	// the names are the simulator's, so build them before measuring
+	av_model_t* models = calloc( count, sizeof(av_model_t) );
+	char* names = malloc( count * 16 );
+	if( models == NULL || names == NULL )
+		return -1;
+
+	for( size_t i=0; i<count; i++ )
+		{
+			snprintf( names + 16*i, 16, "m%u", (unsigned)i );
+			models[i].name = names + 16*i;
+			models[i].prototype = i % 5 ? "part" : "robot";
+			models[i].interface = AV_INTERFACE_GENERIC;
+			models[i].parent = i % 5 ? names + 16*(i - i%5) : NULL;
+			models[i].handle = (void*)(long)(i+1);
+		}
+
+	const size_t before = rss();
+	const double t0 = seconds();
+
+	av_t* av = av_init( "localhost", 8000, ".", 0, "bench", "1" );
+	av_install_clock_callbacks( av, clock_get, NULL );
+	av_install_generic_callbacks( av, pva_set, pva_get, geom_set, geom_get );
+	if( av_register_models( av, models, count ) != 0 )
+		return -1;
+	const double t1 = seconds();
+
+	// the first tick builds the world poses and the spatial index
+	av_tick( av );
+	const double t2 = seconds();
+	const size_t after = rss();
+
+	printf( "%8zu models: %7.1f MB, %5.0f bytes/model, register %.3f s, first tick %.3f s\n",
+					count, (after - before) / 1e6, (double)(after - before) / count,
+					t1 - t0, t2 - t1 );
+
+	av_fini( av );
+	free( names );
+	free( models );
+	return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+	const size_t counts[] = { 10000, 100000, 1000000 };
+
+	// a fresh process for each count, so that none inherits the
+	// heap of the one before
+	for( int i=0; i<3; i++ )
+		{
+			fflush( stdout );
+			const pid_t pid = fork();
+			if( pid == 0 )
+				exit( run( counts[i] ) ? 1 : 0 );
+
+			int status = 0;
+			waitpid( pid, &status, 0 );
+			if( !WIFEXITED(status) || WEXITSTATUS(status) )
+				{
+					printf( "failed at %zu models\n", counts[i] );
+					return 1;
+				}
+		}
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+  File: bench_samples.c
+  Description: benchmark of sensor data served in double and in single
+  precision. A ranger and a fiducial model of each type describe their
+  data with strided views, and a client in the same event loop fetches
+  it over HTTP, in each encoding, timing the round trips.
+  Version: $Id:$
+  License: LGPL v3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <evhttp.h>
+
+#include "avon.h"
+
+#define PORT 8000
+#define REQUESTS 500
+#define TRANSDUCERS 2
+#define SAMPLES 1024
+#define FIDUCIALS 1000
+
+// the simulator's own records, with the sensor data embedded in them
+typedef struct { double bari[4]; int tag; } sample_d_t;
+typedef struct { float bari[4]; int tag; } sample_f_t;
+typedef struct { av_fiducial_t f; int tag; } fiducial_d_t;
+typedef struct { av_fiducial_float_t f; int tag; } fiducial_f_t;
+
+static sample_d_t samples_d[TRANSDUCERS][SAMPLES];
+static sample_f_t samples_f[TRANSDUCERS][SAMPLES];
+static fiducial_d_t fiducials_d[FIDUCIALS];
+static fiducial_f_t fiducials_f[FIDUCIALS];
+
+static av_ranger_transducer_view_t transducers[2][TRANSDUCERS];
+static av_ranger_view_t rangers[2];
+static av_fiducial_view_t fiducials[2];
+
+static void fill( void )
+{
+	for( int t=0; t<TRANSDUCERS; t++ )
+		for( int i=0; i<SAMPLES; i++ )
+			{
+				const double bari[4] = { -M_PI + i * 2*M_PI/SAMPLES, 0,
+																 0.5 + fmod( i*0.37 + t, 7.0 ), i%7 ? 1 : 0 };
+				for( int k=0; k<4; k++ )
+					{
+						samples_d[t][i].bari[k] = bari[k];
+						samples_f[t][i].bari[k] = bari[k];
+					}
+			}
+
+	for( int i=0; i<FIDUCIALS; i++ )
+		{
+			av_fiducial_t* d = &fiducials_d[i].f;
+			av_fiducial_float_t* f = &fiducials_f[i].f;
+			d->id = f->id = i % 97;
+			d->pose[0] = f->pose[0] = i * 0.001;
+			d->pose[2] = f->pose[2] = 0.5 + fmod( i*0.37, 7.0 );
+			d->geom.extent[0] = f->geom.extent[0] = 0.2;
+		}
+
+	for( int k=0; k<2; k++ )
+		{
+			for( int t=0; t<TRANSDUCERS; t++ )
+				{
+					av_ranger_transducer_view_t* tv = &transducers[k][t];
+					tv->sample_count = SAMPLES;
+					tv->type = k ? AV_ELEMENT_FLOAT : AV_ELEMENT_DOUBLE;
+					tv->samples = k ? (void*)samples_f[t][0].bari : (void*)samples_d[t][0].bari;
+					tv->stride = k ? sizeof(sample_f_t) : sizeof(sample_d_t);
+					tv->pose[0] = 0.1 * t;
+				}
+			rangers[k].transducer_count = TRANSDUCERS;
+			rangers[k].transducers = transducers[k];
+
+			fiducials[k].fiducial_count = FIDUCIALS;
+			fiducials[k].type = k ? AV_ELEMENT_FLOAT : AV_ELEMENT_DOUBLE;
+			fiducials[k].fiducials = k ? (void*)&fiducials_f[0].f : (void*)&fiducials_d[0].f;
+			fiducials[k].stride = k ? sizeof(fiducial_f_t) : sizeof(fiducial_d_t);
+		}
+}
+
+// the model handle is one more than the index into the views: 0 for
+// double, 1 for float
+static int ranger_get( void* obj, av_msg_t* m )
+{
+	m->time = 1;
+	m->interface = AV_INTERFACE_RANGER;
+	m->layout = AV_MSG_VIEW;
+	m->data = &rangers[(long)obj - 1];
+	m->len = sizeof(av_ranger_view_t);
+	return 0;
+}
+
+static int fiducial_get( void* obj, av_msg_t* m )
+{
+	m->time = 1;
+	m->interface = AV_INTERFACE_FIDUCIAL;
+	m->layout = AV_MSG_VIEW;
+	m->data = &fiducials[(long)obj - 1];
+	m->len = sizeof(av_fiducial_view_t);
+	return 0;
+}
+
+static uint64_t clock_get( void* obj ) { return 0; }
+static int pva_set( void* obj, av_pva_t* p ) { return 0; }
+static int geom_set( void* obj, av_geom_t* g ) { return 0; }
+
+static int pva_get( void* obj, av_pva_t* p )
+{
+	memset( p, 0, sizeof(*p) );
+	return 0;
+}
+
+static int geom_get( void* obj, av_geom_t* g )
+{
+	memset( g, 0, sizeof(*g) );
+	g->extent[0] = g->extent[1] = 0.3;
+	return 0;
+}
+
+static double seconds( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// one series of requests for the same uri, made one after the other
+typedef struct
+{
+	struct event_base* base;
+	struct evhttp_connection* conn;
+	const char* uri;
+	int remaining;
+	size_t bytes;
+	int failed;
+} series_t;
+
+static void request( series_t* s );
+
+static void reply( struct evhttp_request* req, void* arg )
+{
+	series_t* s = arg;
+	if( req == NULL || evhttp_request_get_response_code( req ) != HTTP_OK )
+		{
+			s->failed = 1;
+			event_base_loopexit( s->base, NULL );
+			return;
+		}
+
+	s->bytes = evbuffer_get_length( evhttp_request_get_input_buffer( req ) );
+	if( --s->remaining > 0 )
+		request( s );
+	else
+		event_base_loopexit( s->base, NULL );
+}
+
+/* each request on a new connection: on a kept-alive one, a small
+	 request waits out the peer's delayed ack, which would swamp the
+	 encoding times being compared */
+static void request( series_t* s )
+{
+	struct evhttp_request* req = evhttp_request_new( reply, s );
+	evhttp_add_header( evhttp_request_get_output_headers( req ), "Host", "localhost" );
+	evhttp_add_header( evhttp_request_get_output_headers( req ), "Connection", "close" );
+	evhttp_make_request( s->conn, req, EVHTTP_REQ_GET, s->uri );
+}
+
+/* fetch [path] from the double and the float model named [prefix]_d
+	 and [prefix]_f, and report the time per request of each */
+static int compare( struct event_base* base, struct evhttp_connection* conn,
+										const char* prefix, const char* path )
+{
+	double usec[2];
+	size_t bytes[2];
+	for( int k=0; k<2; k++ )
+		{
+			char uri[256];
+			snprintf( uri, sizeof(uri), "/%s_%c/%s", prefix, k ? 'f' : 'd', path );
+
+			series_t s = { base, conn, uri, REQUESTS, 0, 0 };
+			const double t0 = seconds();
+			request( &s );
+			event_base_dispatch( base );
+			if( s.failed )
+				{
+					printf( "request for %s failed\n", uri );
+					return -1;
+				}
+			usec[k] = ( seconds() - t0 ) * 1e6 / REQUESTS;
+			bytes[k] = s.bytes;
+		}
+
+	printf( "%-8s %-32s double %7.1f usec %7zu bytes   float %7.1f usec %7zu bytes\n",
+					prefix, path, usec[0], bytes[0], usec[1], bytes[1] );
+	return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+	fill();
+
+	struct event_base* base = event_base_new();
+	av_t* av = av_init( "localhost", PORT, ".", 0, "bench", "1" );
+	av_set_event_base( av, base );
+	av_install_clock_callbacks( av, clock_get, NULL );
+	av_install_generic_callbacks( av, pva_set, pva_get, geom_set, geom_get );
+	av_install_interface_callbacks( av, AV_INTERFACE_RANGER, ranger_get, NULL, NULL, NULL );
+	av_install_interface_callbacks( av, AV_INTERFACE_FIDUCIAL, fiducial_get, NULL, NULL, NULL );
+	av_startup( av );
+
+	av_register_model( av, "ranger_d", "ranger", AV_INTERFACE_RANGER, NULL, (void*)1 );
+	av_register_model( av, "ranger_f", "ranger", AV_INTERFACE_RANGER, NULL, (void*)2 );
+	av_register_model( av, "fid_d", "fiducial", AV_INTERFACE_FIDUCIAL, NULL, (void*)1 );
+	av_register_model( av, "fid_f", "fiducial", AV_INTERFACE_FIDUCIAL, NULL, (void*)2 );
+	av_tick( av );
+
+	struct evhttp_connection* conn =
+		evhttp_connection_base_new( base, NULL, "127.0.0.1", PORT );
+
+	const char* ranger_paths[] = { "data", "data?bearing=-0.5,0.5", "data/min?sectors=8",
+																 "data/histogram?bins=16", "data?frame=world" };
+	const char* fiducial_paths[] = { "data", "data?max_range=2",
+																	 "data?format=binary", "data?format=binary&max_range=2" };
+
+	int err = 0;
+	for( int i=0; i<5 && !err; i++ )
+		err = compare( base, conn, "ranger", ranger_paths[i] );
+	for( int i=0; i<4 && !err; i++ )
+		err = compare( base, conn, "fid", fiducial_paths[i] );
+
+	evhttp_connection_free( conn );
+	av_fini( av );
+	event_base_free( base );
+	return err ? 1 : 0;
+}
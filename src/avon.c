@@ -10,11 +10,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h> // for memset()
+#include <math.h> // for hypot()
 #include <unistd.h> // for chdir(), getcwd()
 #include <assert.h>
+#include <errno.h>
+#include <limits.h> // for INT_MAX
 
 // These headers must be included prior to the libevent headers
 #include <sys/types.h>
+#include <sys/time.h> // for gettimeofday()
 #include <sys/queue.h>
 
 // libevent
@@ -38,12 +42,6 @@ static const char* _package = "Avon";
 static const char* _version = "0.1";
 //static const char* FAVICONFILE = "/favicon.ico";
 
-// root node statically alocated
-_av_node_t _root;
-
-// hash table handle
-_av_node_t* _tree = NULL;
-
 static const char* HTML_BOILERPLATE_HEADER = 
 "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\">\n"
 "<html>\n"
@@ -62,56 +60,26 @@ static const char* HTML_BOILERPLATE_FOOTER =
 
 //<link href=\"style.css\" rel=\"stylesheet\" type=\"text/css\">
 
-// local, statically allocated server instance structure
-struct av
-{
-  char* hostname;
-  unsigned short port;	
-	
-	/** human-readable "host:port" to uniquely identify this instance */
-  char* hostportname; 
-	/** working web server working directory for real files, e.g. favicon.ico */
-	char* rootdir;
-	
-	char* backend_name;
-	char* backend_version;
-
-	/** libevent http server instance */
-  struct evhttp* eh;
-	
-	/**  controls output level - 0 is minimal, non-zero is chatty. */
-	int verbose;
-	
-	// clock callbacks
-	av_clock_get_t clock_get;
-	// user data passed to clock_get callback
-	void* clock_get_user;
-
-	// generic object callbacks
-	av_pva_set_t pva_set;
-	av_pva_get_t pva_get;
-	av_geom_set_t geom_set;
-	av_geom_get_t geom_get;
-
-	// store different data/cmd/cfg callbacks for each type of model
-	av_data_get_t data_get[AV_INTERFACE_COUNT];
-	av_cmd_set_t cmd_set[AV_INTERFACE_COUNT];
-	av_cfg_get_t cfg_get[AV_INTERFACE_COUNT];
-	av_cfg_set_t cfg_set[AV_INTERFACE_COUNT];
-	
-} _av; // statically alocated instance - not thread safe!
-
-
 /* XDR formatting functions defined elsewhere, so that alternative
 	 schemes can be dropped in. */
-char* xdr_tree( const char* );
+char* xdr_tree( av_t*, const _av_node_t*, int, int );
+char* xdr_format_models( av_t*, const UT_array*, int );
+char* xdr_format_seen( av_t*, uint64_t, const _av_seen_t* );
+char* xdr_format_peers( av_t*, uint64_t );
+UT_array* xdr_parse_interest( const char*, char*, size_t );
+int xdr_parse_sync( const char*, char*, size_t, uint64_t*, uint64_t* );
+int xdr_parse_owners( const char*, av_t*, int (*)( av_t*, const char*, const char* ) );
+char* xdr_format_partition( const _av_partition_t*, int );
 char* xdr_format_pva( av_pva_t* );
+char* xdr_format_scheduled( uint64_t, uint32_t );
+char* xdr_format_clock( av_t*, uint64_t, uint64_t, uint64_t, uint64_t );
 char* xdr_format_geom( av_geom_t* );
 
-char* xdr_format_data_ranger( av_msg_t* );
+char* xdr_format_data_ranger( av_msg_t*, const _av_data_opts_t* );
 char* xdr_format_cfg_ranger( av_msg_t* );
 
-char* xdr_format_data_fiducial( av_msg_t* );
+char* xdr_format_data_fiducial( av_msg_t*, const _av_data_opts_t* );
+void* xdr_pack_data_fiducial( av_msg_t*, const _av_data_opts_t*, size_t* );
 char* xdr_format_cfg_fiducial( av_msg_t* );
 
 int xdr_parse_pva( const char*, av_pva_t*);
@@ -119,65 +87,88 @@ int xdr_parse_pva( const char*, av_pva_t*);
 
 static struct
 {
-  char* (*data)( av_msg_t* );
+  char* (*data)( av_msg_t*, const _av_data_opts_t* );
   char* (*cmd)( av_msg_t* );
   char* (*cfg)( av_msg_t* );
+  void* (*pack)( av_msg_t*, const _av_data_opts_t*, size_t* ); // binary data
 } _xdr_format_fn[ AV_INTERFACE_COUNT ] = 
   { 
-	 {NULL,NULL,NULL}, // sim
-	 {NULL,NULL,NULL}, // generic
-	 //{NULL,NULL,NULL}, // position2d
-	 { xdr_format_data_ranger, NULL, xdr_format_cfg_ranger }, // ranger
-	 { xdr_format_data_fiducial, NULL, xdr_format_cfg_fiducial}, // fidicual
+	 {NULL,NULL,NULL,NULL}, // sim
+	 {NULL,NULL,NULL,NULL}, // generic
+	 //{NULL,NULL,NULL,NULL}, // position2d
+	 { xdr_format_data_ranger, NULL, xdr_format_cfg_ranger, NULL }, // ranger
+	 { xdr_format_data_fiducial, NULL, xdr_format_cfg_fiducial, xdr_pack_data_fiducial }, // fidicual
   };
 
-typedef struct
-{
-  av_interface_t interface;
-  void* handle;
-} interface_handle_pair_t;
+// model tree management, defined below
+void tree_init( av_t* av );
+void tree_fini( av_t* av );
 
-int av_init( const char* hostname, 
+// routes requests for model properties, defined below
+void handle_request( struct evhttp_request* req, av_t* av );
+
+av_t* av_init( const char* hostname, 
 						 const uint16_t port, 
 						 const char* rootdir, 
 						 const int verbose,
 						 const char* backend_name,
 						 const char* backend_version )
 {
-	// initialize the single global instance
-	memset( &_av, 0, sizeof(_av) );
+	av_t* av = calloc( 1, sizeof(av_t) );
+	if( av == NULL )
+		return NULL;
 	
-	_av.hostname = strdup( hostname );
-	_av.rootdir = strdup( rootdir );
-	_av.port = port;
-	_av.verbose = verbose;
+	av->hostname = strdup( hostname );
+	av->rootdir = strdup( rootdir );
+	av->port = port;
+	av->verbose = verbose;
 
-	_av.backend_name = strdup( backend_name  );
-	_av.backend_version = strdup( backend_version  );
+	av->backend_name = strdup( backend_name  );
+	av->backend_version = strdup( backend_version  );
 
 	char buf[512];
 	snprintf( buf, 512, "%s:%u", hostname, port );
-	_av.hostportname = strdup( buf );
+	av->hostportname = strdup( buf );
+
+	av->cell_size = AV_SPATIAL_CELL_SIZE;
+	av->run_until = UINT64_MAX; // run freely until a client says otherwise
+	tree_init( av );
 	
 	// json-c library setup
 	//MC_SET_DEBUG(1);
 	
-	return 0; //ok
+	return av; // caller must av_fini()
 }
 
-void av_fini( void )
+void av_fini( av_t* av )
 {
-	if( _av.eh ) evhttp_free(_av.eh);
-	if( _av.hostportname ) free(_av.hostportname);
-	if( _av.hostname ) free(_av.hostname);
-	if( _av.rootdir) free(_av.rootdir);
+	if( av == NULL )
+		return;
+
+	federation_fini( av );
+	partition_fini( av );
+	schedule_fini( av );
+	fiducials_fini( av );
+	spatial_fini( av );
+	tree_fini( av );
+
+	if( av->eh ) evhttp_free(av->eh);
+	// after the server, which tells clock_waiter_closed() of each one
+	if( av->clock_waiters ) utarray_free( av->clock_waiters );
+	if( av->base && !av->base_external ) event_base_free(av->base);
+	if( av->hostportname ) free(av->hostportname);
+	if( av->hostname ) free(av->hostname);
+	if( av->rootdir) free(av->rootdir);
+	if( av->backend_name ) free(av->backend_name);
+	if( av->backend_version ) free(av->backend_version);
+	free( av );
 }
 
-void add_std_hdrs(struct evhttp_request* req )
+void add_std_hdrs( av_t* av, struct evhttp_request* req )
 {
 	char server_str[512];
 	snprintf( server_str, 512, "Avon + %s-%s", 
-						_av.backend_name, _av.backend_version );
+						av->backend_name, av->backend_version );
 	
 	evhttp_add_header(req->output_headers, 
 										"Server", server_str ); // todo: insert version number  
@@ -193,25 +184,48 @@ void add_std_hdrs(struct evhttp_request* req )
 	//	printf( "OUTPUT HEADER: %s = %s\n", item->key, item->value );
 }
 
-void reply_error( struct evhttp_request* req, 
+void reply_error( av_t* av,
+									struct evhttp_request* req, 
 									int code, 
 									const char* description )
 {
-	add_std_hdrs( req );
+	add_std_hdrs( av, req );
 
 	printf( "[Avon] error: %s\n", description );
 	evhttp_send_error( req, code, description );			 
 }
 
-void reply_success( struct evhttp_request* req, 
+void reply_binary( av_t* av,
+									 struct evhttp_request* req, 
+									 int code, 
+									 const char* description, 
+									 const void* payload,
+									 size_t len )
+{
+	if( av->verbose )
+		printf( "[Avon] reply: %s\n", description );
+
+	add_std_hdrs( av, req );
+	evhttp_remove_header( req->output_headers, "Content-Type" );
+	evhttp_add_header( req->output_headers, "Content-Type", "application/octet-stream" );
+
+	struct evbuffer* eb = evbuffer_new();
+	assert(eb);
+	evbuffer_add( eb, payload, len );
+	evhttp_send_reply( req, code, description, eb );			 
+	evbuffer_free( eb );
+}
+
+void reply_success( av_t* av,
+										struct evhttp_request* req, 
 										int code, 
 										const char* description, 
 										const char* payload )
 {
-	if( _av.verbose )
+	if( av->verbose )
 		printf( "[Avon] reply: %s\n", description );
 
-	add_std_hdrs( req );
+	add_std_hdrs( av, req );
 	
 	if( payload )
 		{			
@@ -225,32 +239,82 @@ void reply_success( struct evhttp_request* req,
 		evhttp_send_reply( req, code, description, NULL );			 		
 }
 
-void html_tree( UT_string* s, const char* prefix, const char* name )
+/* copy the value of query argument [key] of [req] into [buf] of
+	 [len] bytes. Returns buf, or NULL if there is no such argument. */
+const char* query_arg( struct evhttp_request* req, const char* key, 
+											 char* buf, size_t len )
+{
+	struct evkeyvalq args;
+	evhttp_parse_query( req->uri, &args );
+	const char* val = evhttp_find_header( &args, key );
+	if( val )
+		snprintf( buf, len, "%s", val );
+	evhttp_clear_headers( &args );
+	return val ? buf : NULL;
+}
+
+/* non-zero if the request asks for poses in the world frame with
+	 ?frame=world, rather than the parent's frame */
+int query_frame_world( struct evhttp_request* req )
+{
+	char buf[16];
+	const char* frame = query_arg( req, "frame", buf, sizeof(buf) );
+	return( frame && strcmp( frame, "world" ) == 0 );
+}
+
+/* parse exactly [count] comma-separated numbers from [str]. Returns
+	 0 on success. */
+static int parse_doubles( const char* str, double* v, int count )
+{
+	for( int i=0; i<count; i++ )
+		{
+			char* end = NULL;
+			v[i] = strtod( str, &end );
+			if( end == str || (*end != (i+1<count ? ',' : '\0')) )
+				return -1;
+			str = end + 1;
+		}
+	return 0;
+}
+
+/* parse [str] as an unsigned decimal, e.g. a time in usec. Returns 0
+	 on success, or -1 if it is empty, signed, out of range or has
+	 anything after the digits. */
+static int parse_uint64( const char* str, uint64_t* v )
+{
+	if( *str < '0' || *str > '9' )
+		return -1;
+
+	char* end = NULL;
+	errno = 0;
+	const unsigned long long n = strtoull( str, &end, 10 );
+	if( *end != '\0' || errno == ERANGE )
+		return -1;
+	*v = n;
+	return 0;
+}
+
+void html_tree( av_t* av, UT_string* s, const char* prefix, const _av_node_t* node )
 {
-	_av_node_t* node = NULL;
-	if( name )
-		HASH_FIND_STR( _tree, name, node );
-	else
-		node = &_root;
-	
 	assert( node );
 	
 	utstring_printf(s, "<tr><td><a href=\"http://%s/%s\">%s</a><td>%s<td>%s</tr>\n",
-									_av.hostportname,
+									av->hostportname,
 									node->id, 
 									node->id, 
 									av_interface_names[node->interface],
 									node->prototype );
 	
-	char** p=NULL;
-  while ( (p=(char**)utarray_next(node->children,p))) 
-		html_tree(s, "", *p );
+	uint32_t* c=NULL;
+  while ( node->children && (c=(uint32_t*)utarray_next(node->children,c))) 
+		html_tree( av, s, "", _av_node_at(av,*c) );
 }
 
 
-void handle_index( struct evhttp_request* req, void* dummy )
+void handle_index( struct evhttp_request* req, av_t* av )
 {
 	assert(req);
+	assert(av);
 	
 	//	printf( "HEADERS: %s\n", req->input_headers );
 
@@ -272,7 +336,7 @@ void handle_index( struct evhttp_request* req, void* dummy )
 			{			 
 				char server_str[512];
 				snprintf( server_str, 512, "%s-%s (%s-%s)", 
-									_av.backend_name, _av.backend_version,
+									av->backend_name, av->backend_version,
 									_package, _version );
 				
 				evhttp_add_header(req->output_headers, 
@@ -290,12 +354,12 @@ void handle_index( struct evhttp_request* req, void* dummy )
 				utstring_printf( page, 
 												 "<h1>%s-%s</h1>"
 												 "<h2>Objects</h2>",
-												 _av.backend_name, // implemented by the simulator
-												 _av.backend_version );
+												 av->backend_name, // implemented by the simulator
+												 av->backend_version );
 				
 				utstring_printf(page, "<table>\n"
 												"<tr><th>name<th>interface<th>prototype</tr>\n" );
-				html_tree( page, "", NULL );
+				html_tree( av, page, "", av->root );
 				utstring_printf(page, "\n</table>\n" );
 								
 				utstring_printf( page, 
@@ -310,20 +374,209 @@ void handle_index( struct evhttp_request* req, void* dummy )
 				free(page);
 			} break;
 		case EVHTTP_REQ_HEAD:						
-		 reply_success( req, HTTP_OK, "Success", NULL );			
+		 reply_success( av, req, HTTP_OK, "Success", NULL );			
 		 break;		 
 		case EVHTTP_REQ_POST:
-			reply_error( req, HTTP_NOTMODIFIED, "POST index not implemented" );			 
+			reply_error( av, req, HTTP_NOTMODIFIED, "POST index not implemented" );			 
 			break;
 		default:
-			reply_error( req, HTTP_NOTMODIFIED, "unknown HTTP request type in handle index" );			 
+			reply_error( av, req, HTTP_NOTMODIFIED, "unknown HTTP request type in handle index" );			 
 		}
 }
 
 
-void handle_tree( struct evhttp_request* req, void* dummy )
+/* the names of the properties that can be selected with ?fields= */
+static const struct
+{
+	const char* name;
+	int field;
+} _field_names[] = 
+	{
+		{ "pva", AV_FIELD_PVA },
+		{ "geom", AV_FIELD_GEOM },
+		{ "data", AV_FIELD_DATA },
+		{ "cfg", AV_FIELD_CFG }
+	};
+
+/* the properties selected by a ?fields=a,b,c argument, or [dflt] if
+	 there is none. Returns -1 if a field name is not recognized. */
+int query_fields( struct evhttp_request* req, int dflt )
+{
+	char buf[128];
+	const char* list = query_arg( req, "fields", buf, sizeof(buf) );
+	if( list == NULL )
+		return dflt;
+	
+	int fields = 0;
+	while( *list )
+		{
+			const size_t len = strcspn( list, "," );
+			
+			int found = 0;
+			for( size_t i=0; i < sizeof(_field_names)/sizeof(_field_names[0]); i++ )
+				if( strlen(_field_names[i].name) == len && 
+						strncmp( list, _field_names[i].name, len ) == 0 )
+					{
+						fields |= _field_names[i].field;
+						found = 1;
+					}
+			
+			if( ! found )
+				return -1;
+			
+			list += len;
+			if( *list == ',' )
+				list++;
+		}
+	return fields;
+}
+
+/* fill [opts] from the arguments of a data request: ?transducers=i,j,..
+	 ?bearing=min,max ?stride=n ?frame=local|world ?sectors=n ?bins=n
+	 ?max=r for rangers, ?id=n ?max_range=r for fiducials, and
+	 ?format=json|binary. Returns -1 if an argument is malformed. */
+int query_data_opts( struct evhttp_request* req, _av_data_opts_t* opts )
+{
+	opts->transducers = UINT64_MAX;
+	opts->transducers_set = 0;
+	opts->stride = 1;
+	opts->bearing_set = 0;
+	opts->frame = AV_FRAME_SENSOR;
+	opts->node = NULL;
+	opts->reduce = AV_REDUCE_NONE;
+	opts->bins = 1;
+	opts->hist_max = 0;
+	opts->id_set = 0;
+	opts->id = 0;
+	opts->max_range = 0;
+	opts->binary = 0;
+
+	char buf[256];
+	const char* list = query_arg( req, "transducers", buf, sizeof(buf) );
+	if( list )
+		{
+			opts->transducers = 0;
+			opts->transducers_set = 1;
+			while( *list )
+				{
+					char* end = NULL;
+					const unsigned long i = strtoul( list, &end, 10 );
+					if( end == list || i >= AV_RANGER_TRANSDUCERS_MAX || 
+							(*end != ',' && *end != '\0') )
+						return -1;
+					opts->transducers |= (uint64_t)1 << i;
+					list = *end ? end + 1 : end;
+				}
+		}
+	
+	const char* bearing = query_arg( req, "bearing", buf, sizeof(buf) );
+	if( bearing )
+		{
+			if( parse_doubles( bearing, opts->bearing, 2 ) != 0 || 
+					opts->bearing[0] > opts->bearing[1] )
+				return -1;
+			opts->bearing_set = 1;
+		}
+	
+	const char* stride = query_arg( req, "stride", buf, sizeof(buf) );
+	if( stride )
+		{
+			char* end = NULL;
+			const unsigned long n = strtoul( stride, &end, 10 );
+			if( end == stride || *end != '\0' || n < 1 || n > UINT32_MAX )
+				return -1;
+			opts->stride = n;
+		}
+	
+	const char* frame = query_arg( req, "frame", buf, sizeof(buf) );
+	if( frame )
+		{
+			if( strcmp( frame, "local" ) == 0 )
+				opts->frame = AV_FRAME_LOCAL;
+			else if( strcmp( frame, "world" ) == 0 )
+				opts->frame = AV_FRAME_WORLD;
+			else
+				return -1;
+		}
+	
+	const char* bins = query_arg( req, "sectors", buf, sizeof(buf) );
+	if( bins == NULL )
+		bins = query_arg( req, "bins", buf, sizeof(buf) );
+	if( bins )
+		{
+			char* end = NULL;
+			const unsigned long n = strtoul( bins, &end, 10 );
+			if( end == bins || *end != '\0' || n < 1 || n > AV_RANGER_SAMPLES_MAX )
+				return -1;
+			opts->bins = n;
+		}
+	
+	const char* max = query_arg( req, "max", buf, sizeof(buf) );
+	if( max && ( parse_doubles( max, &opts->hist_max, 1 ) != 0 || 
+							 opts->hist_max <= 0 ) )
+		return -1;
+	
+	const char* id = query_arg( req, "id", buf, sizeof(buf) );
+	if( id )
+		{
+			char* end = NULL;
+			opts->id = strtoull( id, &end, 10 );
+			if( end == id || *end != '\0' )
+				return -1;
+			opts->id_set = 1;
+		}
+	
+	const char* range = query_arg( req, "max_range", buf, sizeof(buf) );
+	if( range && ( parse_doubles( range, &opts->max_range, 1 ) != 0 || 
+								 opts->max_range <= 0 ) )
+		return -1;
+	
+	const char* format = query_arg( req, "format", buf, sizeof(buf) );
+	if( format )
+		{
+			if( strcmp( format, "binary" ) == 0 )
+				opts->binary = 1;
+			else if( strcmp( format, "json" ) != 0 )
+				return -1;
+		}
+	
+	return 0;
+}
+
+/* reply with the subtree rooted at [node], honoring ?depth=n and
+	 ?fields=pva,geom */
+void reply_tree( av_t* av, struct evhttp_request* req, const _av_node_t* node )
+{
+	char buf[32];
+	const char* depth = query_arg( req, "depth", buf, sizeof(buf) );
+	const int fields = query_fields( req, 0 );
+	
+	// no ?depth= is unlimited, and no tree is deeper than INT_MAX
+	uint64_t levels = 0;
+	if( depth && parse_uint64( depth, &levels ) != 0 )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "tree depth must be a non-negative integer" );
+			return;
+		}
+
+	if( fields < 0 || (fields & ~(AV_FIELD_PVA|AV_FIELD_GEOM)) )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "tree fields must be pva and/or geom" );
+			return;
+		}
+	
+	char* xdr = xdr_tree( av, node, 
+												depth ? (int)( levels < INT_MAX ? levels : INT_MAX ) : -1, 
+												fields );				
+	assert(xdr);
+	reply_success( av, req, HTTP_OK, "Success", xdr );			
+	free(xdr);
+}
+
+void handle_tree( struct evhttp_request* req, av_t* av )
 {
 	assert(req);
+	assert(av);
 	
 	//	printf( "HEADERS: %s\n", req->input_headers );
 
@@ -342,378 +595,975 @@ void handle_tree( struct evhttp_request* req, void* dummy )
 	switch(req->type )
 		{
 		case EVHTTP_REQ_GET:
-			{			 
-				char* xdr = xdr_tree(NULL);				
-				assert(xdr);
-				reply_success( req, HTTP_OK, "Success", xdr );			
-				free(xdr);
-			} break;
+			reply_tree( av, req, av->root );
+			break;
 		case EVHTTP_REQ_HEAD:						
-		 reply_success( req, HTTP_OK, "Success", NULL );			
+		 reply_success( av, req, HTTP_OK, "Success", NULL );			
 		 break;		 
 		case EVHTTP_REQ_POST:
-			reply_error( req, HTTP_NOTMODIFIED, "POST tree not implemented" );			 
+			reply_error( av, req, HTTP_NOTMODIFIED, "POST tree not implemented" );			 
 			break;
 		default:
-			reply_error( req, HTTP_NOTMODIFIED, "unknown HTTP request type in handle tree" );			 
+			reply_error( av, req, HTTP_NOTMODIFIED, "unknown HTTP request type in handle tree" );			 
+		}
+}
+
+
+/* GET /sim/federation: the state of our links to peer servers */
+void handle_federation( struct evhttp_request* req, av_t* av )
+{
+	// ?budget=<usec> asks how deep a relay tree could be within it
+	char arg[32];
+	const char* budget = query_arg( req, "budget", arg, sizeof(arg) );
+	uint64_t usec = 0;
+	if( budget && parse_uint64( budget, &usec ) != 0 )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "federation failed: ?budget= must be a time in usec" );
+			return;
+		}
+
+	char* xdr = xdr_format_peers( av, usec );
+	reply_success( av, req, HTTP_OK, "federation GET OK", xdr );
+	free(xdr);
+}
+
+/* set [node]'s pva. If [dr], its owner is dead reckoning, and sends
+	 an update only when our extrapolation of the last one has drifted,
+	 so keep it to extrapolate in av_tick(). */
+void pva_apply( av_t* av, _av_node_t* node, const av_pva_t* pva, int dr )
+{
+	if( dr )
+		federation_dr_set( av, node, pva );
+	else if( node->dead_reckoned )
+		federation_dr_clear( av, node );
+
+	(*av->pva_set)( node->handle, (av_pva_t*)pva );
+}
+
+/* non-zero if the [count] records from [p] to [end] are all complete,
+	 and nothing follows them */
+static int frame_valid( const uint8_t* p, const uint8_t* end, uint32_t count )
+{
+	for( uint32_t i=0; i<count; i++ )
+		{
+			if( end - p < AV_PUPPET_RECORD_SIZE )
+				return 0;
+
+			uint16_t len;
+			memcpy( &len, p + 18*sizeof(double), sizeof(len) );
+			p += AV_PUPPET_RECORD_SIZE;
+			if( end - p < len )
+				return 0;
+			p += len;
+		}
+	return p == end;
+}
+
+/* POST /sim/puppets: a peer's frame of updates to many puppets,
+	 applied in one pass. See AV_PUPPET_FRAME_MAGIC for the layout. With
+	 ?relay=1 it holds updates for the peers we relay for too, so we
+	 forward it, and skip the puppets that are not ours. */
+void handle_puppets( struct evhttp_request* req, av_t* av )
+{
+	if( req->type != EVHTTP_REQ_POST )
+		{
+			reply_error( av, req, HTTP_NOTMODIFIED, "puppets can only be POSTed" );
+			return;
+		}
+
+	const uint8_t* p = EVBUFFER_DATA(req->input_buffer);
+	const uint8_t* end = p + EVBUFFER_LENGTH(req->input_buffer);
+
+	uint32_t header[2];
+	if( end - p < AV_PUPPET_FRAME_HEADER )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "puppets POST failed: truncated frame" );
+			return;
+		}
+	memcpy( header, p, sizeof(header) );
+	p += AV_PUPPET_FRAME_HEADER;
+
+	if( header[0] != AV_PUPPET_FRAME_MAGIC )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "puppets POST failed: bad magic or byte order" );
+			return;
+		}
+
+	// check the whole frame before we apply or forward any of it
+	if( ! frame_valid( p, end, header[1] ) )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "puppets POST failed: truncated frame" );
+			return;
+		}
+
+	char arg[8];
+	const int relay = query_arg( req, "relay", arg, sizeof(arg) ) != NULL;
+	if( relay )
+		federation_relay( av, EVBUFFER_DATA(req->input_buffer), EVBUFFER_LENGTH(req->input_buffer) );
+
+	uint32_t unknown = 0;
+	for( uint32_t i=0; i<header[1]; i++ )
+		{
+			av_pva_t pva;
+			uint16_t len;
+			uint8_t flags;
+			memcpy( pva.p, p, sizeof(pva.p) ); p += sizeof(pva.p);
+			memcpy( pva.v, p, sizeof(pva.v) ); p += sizeof(pva.v);
+			memcpy( pva.a, p, sizeof(pva.a) ); p += sizeof(pva.a);
+			memcpy( &len, p, sizeof(len) ); p += sizeof(len);
+			flags = *p++;
+
+			_av_node_t* node = NULL;
+			HASH_FIND( hh, av->tree, p, len, node );
+
+			// updates sent before a model migrated to us are stale
+			const _av_owner_t* own = owners_find( av, (const char*)p, len );
+			p += len;
+			if( own && owned_here( av, own ) )
+				continue;
+
+			if( node )
+				pva_apply( av, node, &pva, flags & AV_PUPPET_DR );
+			else
+				unknown++;
+		}
+
+	if( unknown && ! relay )
+		reply_error( av, req, HTTP_NOTFOUND, "puppets POST: some puppets are not registered" );
+	else
+		reply_success( av, req, HTTP_OK, "puppets POST OK", NULL );
+}
+
+static int owner_set( av_t* av, const char* model, const char* owner )
+{
+	partition_apply( av, model, owner );
+	return 0;
+}
+
+/* POST /sim/owners: the member that partitions the federation telling
+	 us who now simulates each mirrored model */
+void handle_owners( struct evhttp_request* req, av_t* av )
+{
+	if( req->type != EVHTTP_REQ_POST )
+		{
+			reply_error( av, req, HTTP_NOTMODIFIED, "owners can only be POSTed" );
+			return;
+		}
+
+  const size_t buflen = EVBUFFER_LENGTH(req->input_buffer);  
+  char* buf = malloc(buflen+1); // space for terminator
+  memcpy( buf, EVBUFFER_DATA(req->input_buffer), buflen );  
+  buf[buflen] = 0; // string terminator
+
+	const int err = xdr_parse_owners( buf, av, owner_set );
+	free( buf );
+
+	if( err )
+		reply_error( av, req, HTTP_BADREQUEST, "owners POST failed: failed to parse XDR payload." );
+	else
+		reply_success( av, req, HTTP_OK, "owners POST OK", NULL );
+}
+
+/* GET /sim/partition: where the partitioner would put each mirrored
+	 model now. With ?format=fed, as the member sections of a
+	 federation file, to start the next run from. */
+void handle_partition( struct evhttp_request* req, av_t* av )
+{
+	char arg[8];
+	const char* format = query_arg( req, "format", arg, sizeof(arg) );
+
+	_av_partition_t part;
+	partition_propose( av, &part );
+	char* xdr = xdr_format_partition( &part, format && strcmp( format, "fed" ) == 0 );
+	partition_free( &part );
+
+	reply_success( av, req, HTTP_OK, "partition GET OK", xdr );
+	free(xdr);
+}
+
+/* POST /sim/interest: a peer telling us which regions it can sense,
+	 so that we mirror only the models inside them */
+void handle_interest( struct evhttp_request* req, av_t* av )
+{
+	if( req->type != EVHTTP_REQ_POST )
+		{
+			reply_error( av, req, HTTP_NOTMODIFIED, "interest can only be POSTed" );
+			return;
 		}
+
+  const size_t buflen = EVBUFFER_LENGTH(req->input_buffer);  
+  char* buf = malloc(buflen+1); // space for terminator
+  memcpy( buf, EVBUFFER_DATA(req->input_buffer), buflen );  
+  buf[buflen] = 0; // string terminator
+
+	char peer[256];
+	UT_array* regions = xdr_parse_interest( buf, peer, sizeof(peer) );
+	free( buf );
+
+	if( regions == NULL )
+		reply_error( av, req, HTTP_BADREQUEST, "interest POST failed: failed to parse XDR payload." );
+	else if( federation_set_interest( av, peer, regions ) != 0 )
+		reply_error( av, req, HTTP_NOTFOUND, "interest POST failed: unknown peer" );
+	else
+		reply_success( av, req, HTTP_OK, "interest POST OK", NULL );
+}
+
+/* POST /sim/sync: a peer advertising its clock and lookahead window */
+void handle_sync( struct evhttp_request* req, av_t* av )
+{
+	if( req->type != EVHTTP_REQ_POST )
+		{
+			reply_error( av, req, HTTP_NOTMODIFIED, "sync can only be POSTed" );
+			return;
+		}
+
+  const size_t buflen = EVBUFFER_LENGTH(req->input_buffer);  
+  char* buf = malloc(buflen+1); // space for terminator
+  memcpy( buf, EVBUFFER_DATA(req->input_buffer), buflen );  
+  buf[buflen] = 0; // string terminator
+
+	char peer[256];
+	uint64_t time = 0, lookahead = 0;
+	const int err = xdr_parse_sync( buf, peer, sizeof(peer), &time, &lookahead );
+	free( buf );
+
+	if( err )
+		reply_error( av, req, HTTP_BADREQUEST, "sync POST failed: failed to parse XDR payload." );
+	else if( federation_set_grant( av, peer, time, lookahead ) != 0 )
+		reply_error( av, req, HTTP_NOTFOUND, "sync POST failed: unknown peer" );
+	else
+		reply_success( av, req, HTTP_OK, "sync POST OK", NULL );
 }
 
+/* GET /sim/fiducials/<id>: the models detecting fiducial <id> at the
+	 last av_tick(). [arg] points just after "fiducials". */
+void handle_fiducials( struct evhttp_request* req, av_t* av, const char* arg )
+{
+	if( req->type != EVHTTP_REQ_GET )
+		{
+			reply_error( av, req, HTTP_NOTMODIFIED, "fiducials are read only" );
+			return;
+		}
+	
+	char* end = NULL;
+	const uint64_t id = *arg == '/' ? strtoull( arg+1, &end, 10 ) : 0;
+	if( end == NULL || end == arg+1 || ( *end != '\0' && *end != '?' ) )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "fiducials needs /sim/fiducials/<id>" );
+			return;
+		}
+	
+	char* xdr = xdr_format_seen( av, id, fiducials_lookup( av, id ) );
+	reply_success( av, req, HTTP_OK, "fiducials GET OK", xdr );
+	free(xdr);
+}
 
-void clock_get( struct evhttp_request* req, void* obj )
+/** Region queries on the spatial index: /sim/query?bbox=x0,y0,x1,y1
+		or /sim/query?near=x,y,r, optionally with &frame=local. */
+void handle_query( struct evhttp_request* req, av_t* av )
 {
 	assert(req);
-	assert(_av.clock_get );
+	assert(av);
+
+	if( req->type != EVHTTP_REQ_GET )
+		{
+			reply_error( av, req, HTTP_NOTMODIFIED, "query supports GET only" );
+			return;
+		}
+
+	struct evkeyvalq args;
+	evhttp_parse_query( req->uri, &args );
+	const char* bbox = evhttp_find_header( &args, "bbox" );
+	const char* near = evhttp_find_header( &args, "near" );
+	
+	UT_array* found = NULL;
+	utarray_new( found, &_av_index_icd );
+	
+	// a region that is given must be well formed: a bad bbox= is an
+	// error, not a reason to try near=
+	double v[4];
+	int ok = 1;
+	if( bbox )
+		{
+			if( parse_doubles( bbox, v, 4 ) == 0 && v[0] <= v[2] && v[1] <= v[3] )
+				spatial_query( av, v[0], v[1], v[2], v[3], found );
+			else
+				ok = 0;
+		}
+	else if( near && parse_doubles( near, v, 3 ) == 0 && v[2] >= 0 )
+		spatial_query_near( av, v[0], v[1], v[2], found );
+	else
+		ok = 0;
+	
+	if( ok )
+		{
+			// query regions are in the world frame, so poses are too,
+			// unless the client asks for ?frame=local
+			char buf[16];
+			const char* frame = query_arg( req, "frame", buf, sizeof(buf) );
+			const int world = !( frame && strcmp( frame, "local" ) == 0 );
+			
+			char* xdr = xdr_format_models( av, found, world );
+			reply_success( av, req, HTTP_OK, "query GET OK", xdr );
+			free(xdr);
+		}
+	else
+		reply_error( av, req, HTTP_BADREQUEST, 
+								 "query needs bbox=x0,y0,x1,y1 or near=x,y,r" );
+	
+	utarray_free( found );
+	evhttp_clear_headers( &args );
+}
+
+uint64_t wall_usec( void )
+{
+	struct timeval tv;
+	gettimeofday( &tv, NULL );
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+/* A POST /sim/clock run lets the simulator run up to run_until, then
+	 holds it there. While stepping it may take any step, as av_tick()
+	 counts them. */
+uint64_t clock_bound( av_t* av )
+{
+	if( av->run_steps )
+		return UINT64_MAX;
+	return av->run_until;
+}
+
+static void clock_reply( av_t* av, struct evhttp_request* req, uint64_t t0, uint64_t t1 )
+{
+	char* xdr = xdr_format_clock( av, t0, t1, wall_usec(), 
+																(*av->clock_get)( av->clock_get_user ) );
+	reply_success( av, req, HTTP_OK, "clock OK", xdr );
+	free( xdr );
+}
+
+// a client gave up waiting for its run, so forget its request
+static void clock_waiter_closed( struct evhttp_connection* evcon, void* arg )
+{
+	av_t* av = arg;
+	for( unsigned i=0; i<utarray_len( av->clock_waiters ); )
+		{
+			_av_clock_waiter_t* w = (_av_clock_waiter_t*)utarray_eltptr( av->clock_waiters, i );
+			if( w->req->evcon == evcon )
+				utarray_erase( av->clock_waiters, i, 1 );
+			else
+				i++;
+		}
+}
+
+// reply to the POSTs waiting for the run
+static void clock_release( av_t* av )
+{
+	if( av->clock_waiters == NULL )
+		return;
+
+	for( _av_clock_waiter_t* w = (_av_clock_waiter_t*)utarray_front( av->clock_waiters );
+			 w;
+			 w = (_av_clock_waiter_t*)utarray_next( av->clock_waiters, w ) )
+		{
+			evhttp_connection_set_closecb( w->req->evcon, NULL, NULL );
+			clock_reply( av, w->req, w->t0, w->t1 );
+		}
+	utarray_clear( av->clock_waiters );
+}
+
+/* reply to the POSTs waiting for the run once it is over, and tell an
+	 event-driven simulator whenever its bound moves, either way */
+static void clock_tick( av_t* av )
+{
+	const uint64_t now = (*av->clock_get)( av->clock_get_user );
+	if( av->run_steps && --av->run_steps == 0 )
+		av->run_until = now; // hold here
+
+	if( av->run_steps == 0 && av->run_until != UINT64_MAX && now >= av->run_until )
+		clock_release( av );
+
+	const uint64_t limit = av_safe_time( av );
+	if( limit != av->limit_told )
+		{
+			av->limit_told = limit;
+			if( av->clock_limit )
+				(*av->clock_limit)( av->clock_limit_user, limit );
+		}
+}
+
+/* GET /sim/clock: sim time, with our wall clock when the request
+	 arrived (t1) and when we replied (t2), and the client's own send
+	 time echoed back if it passed ?t0=<usec>. As in NTP, with its
+	 receive time t3 a client estimates our wall clock offset as
+	 ((t1-t0)+(t2-t3))/2 and the round trip delay as (t3-t0)-(t2-t1),
+	 and so how sim time relates to its own wall clock.
+
+	 POST /sim/clock controls how far the simulator may run, through
+	 av_safe_time(): ?runfor=<usec> runs it for that much sim time,
+	 ?step=<n> for n ticks, and ?run=1 lets it run freely again. The
+	 reply to runfor and step comes when the run is over, so a batch
+	 client needs no timing of its own, and the simulator can run
+	 faster than real time. */
+void clock_get( struct evhttp_request* req, av_t* av )
+{
+	assert(req);
+	assert(av);
+	assert(av->clock_get );
+
+	const uint64_t t1 = wall_usec();
+	char arg[32];
+	const char* t0 = query_arg( req, "t0", arg, sizeof(arg) );
+	uint64_t client = 0;
+	if( t0 && parse_uint64( t0, &client ) != 0 )
+		{
+			reply_error( av, req, HTTP_BADREQUEST, "clock failed: ?t0= must be a time in usec" );
+			return;
+		}
 
 	switch(req->type )
 		{
 		case EVHTTP_REQ_GET:
-			{			 
-				uint64_t t = (*_av.clock_get)( obj ); 
-				uint64_t sec = t / 1e6;
-				uint64_t usec = t - (sec*1e6);
-				char buf[128];
-				snprintf( buf, 128, "\"time\" : %llu.%llu", sec, usec );
-				reply_success( req, HTTP_OK, "OK", buf );
-			} break;
+			clock_reply( av, req, client, t1 );
+			break;
 		case EVHTTP_REQ_HEAD:						
-			reply_success( req, HTTP_OK, "OK", NULL);			
+			reply_success( av, req, HTTP_OK, "OK", NULL);			
 			break;		 
 		case EVHTTP_REQ_POST:
-			reply_error( req, HTTP_NOTMODIFIED, "clock POST not implemented" );
-			break;
+			{
+				const uint64_t now = (*av->clock_get)( av->clock_get_user );
+				const char* runfor = query_arg( req, "runfor", arg, sizeof(arg) );
+				uint64_t usec = 0;
+				if( runfor && parse_uint64( runfor, &usec ) != 0 )
+					{
+						reply_error( av, req, HTTP_BADREQUEST, "clock POST failed: ?runfor= must be a time in usec" );
+						return;
+					}
+
+				char sarg[32];
+				const char* step = query_arg( req, "step", sarg, sizeof(sarg) );
+				uint64_t steps = 0;
+				if( step && ( parse_uint64( step, &steps ) != 0 || steps > UINT32_MAX ) )
+					{
+						reply_error( av, req, HTTP_BADREQUEST, "clock POST failed: ?step= must be a count of ticks" );
+						return;
+					}
+
+				if( ! runfor && ! step && ! query_arg( req, "run", sarg, sizeof(sarg) ) )
+					{
+						reply_error( av, req, HTTP_BADREQUEST, "clock POST needs runfor, step or run" );
+						return;
+					}
+
+				// a new run ends any earlier one
+				clock_release( av );
+
+				if( runfor )
+					{
+						av->run_until = usec < UINT64_MAX - now ? now + usec : UINT64_MAX;
+						av->run_steps = 0;
+					}
+				else if( step )
+					{
+						av->run_steps = steps;
+						if( av->run_steps == 0 )
+							av->run_until = now; // no steps: just hold
+					}
+				else
+					{
+						av->run_until = UINT64_MAX;
+						av->run_steps = 0;
+					}
+
+				// an event-driven simulator learns its new bound at once
+				av->limit_told = av_safe_time( av );
+				if( av->clock_limit )
+					(*av->clock_limit)( av->clock_limit_user, av->limit_told );
+
+				// freeing the clock, or a run that is over already, replies at once
+				if( av->run_steps == 0 && ( av->run_until == UINT64_MAX || now >= av->run_until ) )
+					{
+						clock_reply( av, req, client, t1 );
+						return;
+					}
+
+				if( av->clock_waiters == NULL )
+					utarray_new( av->clock_waiters, &_av_clock_waiter_icd );
+				_av_clock_waiter_t w = { req, client, t1 };
+				utarray_push_back( av->clock_waiters, &w );
+				evhttp_connection_set_closecb( req->evcon, clock_waiter_closed, av );
+			} break;
 		default:
-			reply_error( req, HTTP_NOTMODIFIED, "unrecognized request type" );
+			reply_error( av, req, HTTP_NOTMODIFIED, "unrecognized request type" );
 		}
 }
 
-void av_startup()
+void av_startup( av_t* av )
 {
-  if( !_av.clock_get )
+	assert(av);
+
+  if( !av->clock_get )
 		{
 		puts( "[Avon] Error: clock callbacks must be installed before startup. Quit." );
 		exit(-1);
 	 }
 
-  if( !_av.pva_set ||
-		!_av.pva_get ||
-		!_av.geom_set || 
-		!_av.geom_get )
+  if( !av->pva_set ||
+		!av->pva_get ||
+		!av->geom_set || 
+		!av->geom_get )
 	 {
 		puts( "[Avon] Error: generic callbacks must be installed before startup. Quit." );
 		exit(-1);
 	 }
   
 	// set up server root for real files
-	if( chdir( _av.rootdir ) )
+	if( chdir( av->rootdir ) )
 		{
-			printf( "failed to set %s as working directory. Quit.\n", _av.rootdir );
+			printf( "failed to set %s as working directory. Quit.\n", av->rootdir );
 			exit(-1);
 		}
 
 	char* cwd = getcwd(NULL,0);
 	
-  if( _av.verbose )
+  if( av->verbose )
     {
       printf( "[%s] %s %s hosting %s %s at http://%s root %s\n", 
 							_package, 
 							_package,
 							_version,
-							_av.backend_name, // implemented by the simulator
-							_av.backend_version,
-							_av.hostportname,
+							av->backend_name, // implemented by the simulator
+							av->backend_version,
+							av->hostportname,
 							cwd );
     }
 	
 	free(cwd);
 	
-  // Set up the HTTP server
-  event_init();
+  // Set up the HTTP server on this instance's own event base, unless
+  // the host supplied one
+	if( av->base == NULL )
+		av->base = event_base_new();
+  assert(av->base);
   
-  if( _av.verbose )
+  if( av->verbose )
     {
       printf("[%s] Starting HTTP server...", _package );
       fflush(stdout);
     }
 	
-  _av.eh = evhttp_start( _av.hostname, _av.port);
-  assert(_av.eh);
+  av->eh = evhttp_new( av->base );
+  assert(av->eh);
+
+  if( evhttp_bind_socket( av->eh, av->hostname, av->port ) )
+		{
+			printf( "[Avon] Error: failed to bind to %s. Quit.\n", av->hostportname );
+			exit(-1);
+		}
 	
 	// set specific callbacks here (e.g. sim things, favicon, homepage, etc );
 
-	//evhttp_set_cb( _av.eh, FAVICONFILE, FaviconCallback, (void*)this );
+	//evhttp_set_cb( av->eh, FAVICONFILE, FaviconCallback, (void*)this );
 
 	// install all the sim handlers
-	//evhttp_set_cb( _av.eh, "/sim/clock", (evhttp_cb_t)SimClockCb, (void*)this );
+	evhttp_set_cb( av->eh, "/sim/clock", (evhttp_cb_t)clock_get, av );
 	
-	evhttp_set_cb( _av.eh, "/sim/tree", (evhttp_cb_t)handle_tree, NULL );
-
-	evhttp_set_cb( _av.eh, "/", (evhttp_cb_t)handle_index, NULL );
-	evhttp_set_cb( _av.eh, "/index.html", (evhttp_cb_t)handle_index, NULL );
-
-  //evhttp_set_gencb( _av.eh, &WebSim::EventCallback, (void*)this );
+	evhttp_set_cb( av->eh, "/sim/tree", (evhttp_cb_t)handle_tree, av );
+	evhttp_set_cb( av->eh, "/sim/query", (evhttp_cb_t)handle_query, av );
+	evhttp_set_cb( av->eh, "/sim/federation", (evhttp_cb_t)handle_federation, av );
+	evhttp_set_cb( av->eh, "/sim/interest", (evhttp_cb_t)handle_interest, av );
+	evhttp_set_cb( av->eh, "/sim/sync", (evhttp_cb_t)handle_sync, av );
+	evhttp_set_cb( av->eh, "/sim/puppets", (evhttp_cb_t)handle_puppets, av );
+	evhttp_set_cb( av->eh, "/sim/owners", (evhttp_cb_t)handle_owners, av );
+	evhttp_set_cb( av->eh, "/sim/partition", (evhttp_cb_t)handle_partition, av );
+
+	evhttp_set_cb( av->eh, "/", (evhttp_cb_t)handle_index, av );
+	evhttp_set_cb( av->eh, "/index.html", (evhttp_cb_t)handle_index, av );
+
+	// everything else is a model request, routed by a tree lookup
+  evhttp_set_gencb( av->eh, (evhttp_cb_t)handle_request, av );
   
-  if( _av.verbose )
+  if( av->verbose )
     {
       puts( " done." );
     }
 }
 
-void av_wait( void ) 
+void av_wait( av_t* av ) 
 { 
-  event_loop( EVLOOP_ONCE );
+  event_base_loop( av->base, EVLOOP_ONCE );
 }    
 
-void av_check()
-{ 
-  event_loop( EVLOOP_NONBLOCK );
-}    
+void av_check( av_t* av )
+{ 
+  event_base_loop( av->base, EVLOOP_NONBLOCK );
+}    
+
+int av_set_event_base( av_t* av, struct event_base* base )
+{
+	assert(av);
+	assert(base);
+
+	if( av->eh ) // too late: the server is already listening on another base
+		{
+			puts( "[Avon] error: av_set_event_base() must be called before av_startup()" );
+			return -1;
+		}
+
+	if( av->base && !av->base_external )
+		event_base_free( av->base );
+
+	av->base = base;
+	av->base_external = 1;
+	return 0; //ok
+}
+
+struct event_base* av_get_event_base( av_t* av )
+{
+	assert(av);
+	return av->base;
+}
 
-void handle_summary( struct evhttp_request* req, interface_handle_pair_t* ihp )
+void handle_summary( struct evhttp_request* req, _av_node_t* node )
 {
 	assert(req);
-	assert(ihp);
-	assert(ihp->handle);
+	assert(node);
+	assert(node->handle);
 	
-	av_interface_t interface = ihp->interface;
-	void* handle = ihp->handle;
+	av_t* av = node->av;
+	av_interface_t interface = node->interface;
+	void* handle = node->handle;
 	
   switch(req->type )
 		{
 		case EVHTTP_REQ_GET:
 			{
-				av_pva_t pva;
-				(*_av.pva_get)( handle, &pva );				
-				char* xdr_pva = xdr_format_pva( &pva );			 
+				// ?fields= selects the parts wanted, so that we don't call
+				// back or format the rest
+				const int fields = query_fields( req, AV_FIELD_PVA | AV_FIELD_CFG | AV_FIELD_DATA );
+				if( fields < 0 )
+					{
+						reply_error( av, req, HTTP_BADREQUEST, "unknown field: use pva, geom, data or cfg" );
+						break;
+					}
+
+				char* xdr_pva = NULL;
+				if( fields & AV_FIELD_PVA )
+					{
+						av_pva_t pva;
+						(*av->pva_get)( handle, &pva );				
+						xdr_pva = xdr_format_pva( &pva );			 
+					}
 				
+				char* xdr_geom = NULL;
+				if( fields & AV_FIELD_GEOM )
+					{
+						av_geom_t geom;
+						(*av->geom_get)( handle, &geom );				
+						xdr_geom = xdr_format_geom( &geom );			 
+					}
+
 				char* xdr_data = NULL;
-				if( _av.data_get[interface] && _xdr_format_fn[interface].data )
+				if( (fields & AV_FIELD_DATA) && 
+						av->data_get[interface] && _xdr_format_fn[interface].data )
 					{						
 						av_msg_t data;
-						(*_av.data_get[interface])( handle, &data );			 
-						xdr_data = _xdr_format_fn[interface].data( &data );
+						bzero( &data, sizeof(data) );
+						(*av->data_get[interface])( handle, &data );			 
+						xdr_data = _xdr_format_fn[interface].data( &data, NULL );
 						assert(xdr_data);				
 					}
 				
 				char* xdr_cfg = NULL;
-				if( _av.cfg_get[interface]  && _xdr_format_fn[interface].cfg )
+				if( (fields & AV_FIELD_CFG) && 
+						av->cfg_get[interface]  && _xdr_format_fn[interface].cfg )
 					{
 						av_msg_t cfg;
-						(*_av.cfg_get[interface])( handle, &cfg );			 
+						bzero( &cfg, sizeof(cfg) );
+						(*av->cfg_get[interface])( handle, &cfg );			 
 						xdr_cfg = _xdr_format_fn[interface].cfg( &cfg );
 						assert(xdr_cfg);				
 					}
 				
-				// combine the three parts into a single summary of this object's state
+				// combine the parts into a single summary of this object's state
 				UT_string* s = uts_new();
-				utstring_printf(s, "%s\n%s\n%s ", 
-												xdr_pva, 
+				utstring_printf(s, "%s\n%s\n%s\n%s ", 
+												xdr_pva ? xdr_pva : "", 
+												xdr_geom ? xdr_geom : "", 
 												xdr_cfg ? xdr_cfg : "",
 												xdr_data ? xdr_data : "" );
-				reply_success( req, HTTP_OK, "model GET OK", utstring_body(s) );			
+				reply_success( av, req, HTTP_OK, "model GET OK", utstring_body(s) );			
 				
 				// clean up
 				utstring_free(s);
 				free(xdr_pva);			 
+				free(xdr_geom);			 
 				free(xdr_data);
 				free(xdr_cfg);
 		  }
 		break;
 		
 	 case EVHTTP_REQ_HEAD:						
-		 reply_success( req, HTTP_OK, "model HEAD OK", NULL );									
+		 reply_success( av, req, HTTP_OK, "model HEAD OK", NULL );									
 		 break;
 		 
 	 case EVHTTP_REQ_POST:
 		{
-		  /* 				if( _av.data */
+		  /* 				if( av->data */
 		  /* 				av_data_t data; */
 		  /* 				if( parse_xdr_data( req->payload, &data ) != 0 ) */
 		  /* 					puts( "ERROR: failed to parse XDR on POST data" ); */
 		  /* 				else				 */
-		  /* 					(*_av.data_set)( handle, &data );  */
+		  /* 					(*av->data_set)( handle, &data );  */
 		  
-		  reply_error( req, HTTP_NOTMODIFIED, "model POST error: model cannot be set." );									
+		  reply_error( av, req, HTTP_NOTMODIFIED, "model POST error: model cannot be set." );									
 		}	break;	
 	 default:
-		reply_error( req, HTTP_NOTMODIFIED, "model unrecognized action" );						
+		reply_error( av, req, HTTP_NOTMODIFIED, "model unrecognized action" );						
 	 }
 }
 
-void handle_data( struct evhttp_request* req, interface_handle_pair_t* ihp )
+/* GET /name/data, or a reduction of it such as /name/data/min if
+	 [reduce] is not AV_REDUCE_NONE */
+void handle_data( struct evhttp_request* req, _av_node_t* node, int reduce )
 {	
 	assert(req);
-	assert(ihp);
-	assert(ihp->handle);
+	assert(node);
+	assert(node->handle);
 
-	av_interface_t interface = ihp->interface;
-	void* handle = ihp->handle;
+	av_t* av = node->av;
+	av_interface_t interface = node->interface;
+	void* handle = node->handle;
+	
+	if( reduce != AV_REDUCE_NONE && interface != AV_INTERFACE_RANGER )
+		{
+			reply_error( av, req, HTTP_NOTFOUND, "data reductions are only available for rangers" );
+			return;
+		}
 	
   switch(req->type )
 	 {
 	 case EVHTTP_REQ_GET:
-		if( _av.data_get[interface] && _xdr_format_fn[interface].data )
+		if( av->data_get[interface] && _xdr_format_fn[interface].data )
 		  {
+				_av_data_opts_t opts;
+				if( query_data_opts( req, &opts ) != 0 )
+					{
+						reply_error( av, req, HTTP_BADREQUEST, 
+												 "data GET: bad transducers=i,j,.. bearing=min,max stride=n or frame=local|world" );
+						break;
+					}
+				opts.node = node;
+				opts.reduce = reduce;
+
+				if( opts.binary && _xdr_format_fn[interface].pack == NULL )
+					{
+						reply_error( av, req, HTTP_NOTFOUND, "data GET: no binary format for interface" );
+						break;
+					}
+
 				av_msg_t data;
-				(*_av.data_get[interface])( handle, &data );			 
-				char* xdr = _xdr_format_fn[interface].data( &data );
+				bzero( &data, sizeof(data) );
+				(*av->data_get[interface])( handle, &data );			 
+
+				if( opts.binary )
+					{
+						size_t len = 0;
+						void* bin = _xdr_format_fn[interface].pack( &data, &opts, &len );
+						assert(bin);
+						reply_binary( av, req, HTTP_OK, "data GET OK", bin, len );
+						free(bin);
+						break;
+					}
+
+				char* xdr = _xdr_format_fn[interface].data( &data, &opts );
 				assert(xdr);				
-				reply_success( req, HTTP_OK, "data GET OK", xdr );
+				reply_success( av, req, HTTP_OK, "data GET OK", xdr );
 				free(xdr);
 		  }
 		else			
-		  reply_error( req, HTTP_NOTFOUND, "data GET not found: No callback and/or formatter installed for interface" );									
+		  reply_error( av, req, HTTP_NOTFOUND, "data GET not found: No callback and/or formatter installed for interface" );									
 		break;
 		
 	 case EVHTTP_REQ_HEAD:						
-		 reply_success( req, HTTP_OK, "data HEAD OK", NULL );									
+		 reply_success( av, req, HTTP_OK, "data HEAD OK", NULL );									
 		 break;
 		 
 	 case EVHTTP_REQ_POST:
 		{
-		  /* 				if( _av.data */
+		  /* 				if( av->data */
 		  /* 				av_data_t data; */
 		  /* 				if( parse_xdr_data( req->payload, &data ) != 0 ) */
 		  /* 					puts( "ERROR: failed to parse XDR on POST data" ); */
 		  /* 				else				 */
-		  /* 					(*_av.data_set)( handle, &data );  */
+		  /* 					(*av->data_set)( handle, &data );  */
 		  
-		  reply_error( req, HTTP_NOTMODIFIED, "data POST error: data cannot be set." );									
+		  reply_error( av, req, HTTP_NOTMODIFIED, "data POST error: data cannot be set." );									
 		}	break;	
 	 default:
-		reply_error( req, HTTP_NOTMODIFIED, "data unrecognized action" );						
+		reply_error( av, req, HTTP_NOTMODIFIED, "data unrecognized action" );						
 	 }
 }
 
-void handle_cfg( struct evhttp_request* req, interface_handle_pair_t* ihp )
+void handle_cfg( struct evhttp_request* req, _av_node_t* node )
 {	
-	av_interface_t interface = ihp->interface;
-	void* handle = ihp->handle;
+	av_t* av = node->av;
+	av_interface_t interface = node->interface;
+	void* handle = node->handle;
 
   switch(req->type )
 	 {
 	 case EVHTTP_REQ_GET:
-		if( _av.cfg_get[interface]  && _xdr_format_fn[interface].cfg )
+		if( av->cfg_get[interface]  && _xdr_format_fn[interface].cfg )
 		  {
 			 av_msg_t cfg;
-			 (*_av.cfg_get[interface])( handle, &cfg );			 
+			 bzero( &cfg, sizeof(cfg) );
+			 (*av->cfg_get[interface])( handle, &cfg );			 
 			 char* xdr = _xdr_format_fn[interface].cfg( &cfg );
 			 assert(xdr);				
-			 reply_success( req, HTTP_OK, "cfg GET OK", xdr );
+			 reply_success( av, req, HTTP_OK, "cfg GET OK", xdr );
 			 free(xdr);
 		  }
 		else			
-		  reply_error( req, HTTP_NOTFOUND, "cfg GET not found: No callback and/or formatter installed for interface" );									
+		  reply_error( av, req, HTTP_NOTFOUND, "cfg GET not found: No callback and/or formatter installed for interface" );									
 		break;
 		
 	 case EVHTTP_REQ_HEAD:						
-		 reply_success( req, HTTP_OK, "cfg HEAD OK", NULL );									
+		 reply_success( av, req, HTTP_OK, "cfg HEAD OK", NULL );									
 		 break;
 		 
 	 case EVHTTP_REQ_POST:
 		{
-		  /* 				if( _av.cfg */
+		  /* 				if( av->cfg */
 		  /* 				av_cfg_t cfg; */
 		  /* 				if( parse_xdr_cfg( req->payload, &cfg ) != 0 ) */
 		  /* 					puts( "ERROR: failed to parse XDR on POST cfg" ); */
 		  /* 				else				 */
-		  /* 					(*_av.cfg_set)( handle, &cfg );  */
+		  /* 					(*av->cfg_set)( handle, &cfg );  */
 		  
-		  reply_error( req, HTTP_NOTMODIFIED, "cfg POST error: cfg cannot be set." );									
+		  reply_error( av, req, HTTP_NOTMODIFIED, "cfg POST error: cfg cannot be set." );									
 		}	break;	
 	 default:
 		printf( "warning: unknown request type %d in handle_cfg\n", req->type );
-		reply_error( req, HTTP_NOTMODIFIED, "cfg unrecognized action" );						
+		reply_error( av, req, HTTP_NOTMODIFIED, "cfg unrecognized action" );						
 	 }
 }
 
 
-void handle_pva_get( struct evhttp_request* req, void* handle )
+void handle_pva_get( struct evhttp_request* req, _av_node_t* node )
 {
 	assert(req);
-	assert(handle);
+	assert(node);
 
+	av_t* av = node->av;
   av_pva_t pva;
-  (*_av.pva_get)( handle, &pva );
+  (*av->pva_get)( node->handle, &pva );
+
+	// ?frame=world substitutes the pose computed at the last tick
+	if( query_frame_world( req ) )
+		memcpy( pva.p, node->world, sizeof(pva.p) );
   
   // encode the PVA into xdr
   char* xdr = xdr_format_pva( &pva );			 
-  reply_success( req, HTTP_OK, "pva GET OK", xdr);			
+  reply_success( av, req, HTTP_OK, "pva GET OK", xdr);			
   free(xdr);
 }
 
 
-void handle_pva_set( struct evhttp_request* req, void* handle )
+void handle_pva_set( struct evhttp_request* req, _av_node_t* node )
 {
 	assert(req);
-	assert(handle);
+	assert(node);
+
+	av_t* av = node->av;
 
   const size_t buflen = EVBUFFER_LENGTH(req->input_buffer);  
   char* buf = malloc(buflen+1); // space for terminator
   memcpy( buf, EVBUFFER_DATA(req->input_buffer), buflen );  
   buf[buflen] = 0; // string terminator
   
-  printf( "received %lu bytes\n", (unsigned long)buflen );
-  printf( "   %s\n", buf );
+  if( av->verbose )
+	 {
+		printf( "received %lu bytes\n", (unsigned long)buflen );
+		printf( "   %s\n", buf );
+	 }
 
   av_pva_t pva;
   int result = xdr_parse_pva( buf, &pva );
+  free( buf );
+
+  char arg[32];
+  const int dr = query_arg( req, "dr", arg, sizeof(arg) ) != NULL;
+  const char* when = query_arg( req, "at", arg, sizeof(arg) );
+  uint64_t at = 0;
 
   if( result != 0 )			  
-	 reply_error( req, HTTP_NOTMODIFIED, "pva POST failed: failed to parse XDR payload." );						
+	 reply_error( av, req, HTTP_NOTMODIFIED, "pva POST failed: failed to parse XDR payload." );						
+  else if( when && parse_uint64( when, &at ) != 0 )
+	 reply_error( av, req, HTTP_BADREQUEST, "pva POST failed: ?at= must be a time in usec." );
+  else if( at > (*av->clock_get)( av->clock_get_user ) )
+	 {
+		// ?at=<usec>: hold it for the tick at that sim time
+		const uint32_t queued = schedule_pva( av, node, at, &pva, dr );
+		char* xdr = xdr_format_scheduled( at, queued );
+		reply_success( av, req, HTTP_OK, "pva POST scheduled", xdr );
+		free( xdr );
+	 }
   else
 	 {
 		// set the new PVA
-		(*_av.pva_set)( handle, &pva );				
+		pva_apply( av, node, &pva, dr );
 		// get the PVA and return it so the client can see what happened
-		handle_pva_get( req, handle );
+		handle_pva_get( req, node );
 	 }
 } 
 
 
-void handle_pva( struct evhttp_request* req, void* handle )
+void handle_pva( struct evhttp_request* req, _av_node_t* node )
 {
 	assert(req);
-	assert(handle);
+	assert(node);
+
+	av_t* av = node->av;
 
   switch(req->type )
 	 {
 	 case EVHTTP_REQ_GET:
-		handle_pva_get( req, handle );
+		handle_pva_get( req, node );
 		break;
 	 case EVHTTP_REQ_HEAD:						
 		puts( "warning: pva HEAD not implemented" );
-		reply_success( req, HTTP_OK, "pva HEAD OK", NULL);			
+		reply_success( av, req, HTTP_OK, "pva HEAD OK", NULL);			
 		break;		 
 	 case EVHTTP_REQ_POST:
-		handle_pva_set( req, handle );
+		handle_pva_set( req, node );
 		break;
 	 default:
-		reply_error( req, HTTP_NOTMODIFIED, "pva unrecognized action" );						
+		reply_error( av, req, HTTP_NOTMODIFIED, "pva unrecognized action" );						
 	 }
 }
 
-void handle_geom( struct evhttp_request* req, void* handle )
+void handle_geom( struct evhttp_request* req, _av_node_t* node )
 {
 	assert(req);
-	assert(handle);
+	assert(node);
+
+	av_t* av = node->av;
 
   switch(req->type )
 	 {
 	 case EVHTTP_REQ_GET:
 		 {
 			av_geom_t geom;
-			 (*_av.geom_get)( handle, &geom );
+			 (*av->geom_get)( node->handle, &geom );
 			 
 			 // encode the GEOM into xdr
 			 char* xdr = xdr_format_geom( &geom );
 			 assert(xdr);
-			 reply_success( req, HTTP_OK, "geom GET OK", xdr);			
+			 reply_success( av, req, HTTP_OK, "geom GET OK", xdr);			
 			 free(xdr);
 		 } break;
 	 case EVHTTP_REQ_HEAD:						
 		 puts( "warning: geom HEAD not implemented" );
-		 reply_success( req, HTTP_OK, "geom HEAD OK", NULL);			
+		 reply_success( av, req, HTTP_OK, "geom HEAD OK", NULL);			
 		 break;		 
 	 case EVHTTP_REQ_POST:
 		 {
@@ -721,170 +1571,726 @@ void handle_geom( struct evhttp_request* req, void* handle )
 			 // todo- parse GEOM from XDR
 			 bzero( &geom, sizeof(geom));
 			 
-			 (*_av.geom_set)( handle, &geom );
+			 (*av->geom_set)( node->handle, &geom );
+			 node->geom_known = 0; // refetch the radius at the next tick
 			 
 			 puts( "warning: geom POST not implemented" );
-			 reply_error( req, HTTP_NOTMODIFIED, "geom POST error: not imlemented" );						
+			 reply_error( av, req, HTTP_NOTMODIFIED, "geom POST error: not imlemented" );						
 		 } break;
 	 default:
 		 printf( "warning: unknown request type %d in handle_geom\n", req->type );
-		 reply_error( req, HTTP_NOTMODIFIED, "geom unrecognized action" );						
+		 reply_error( av, req, HTTP_NOTMODIFIED, "geom unrecognized action" );						
 	 }
 }
 
-void print_table( void )
+/* returns non-zero if the [len] characters at [prop] are exactly [key] */
+static int prop_is( const char* prop, size_t len, const char* key )
+{
+	return( strlen(key) == len && strncmp( prop, key, len ) == 0 );
+}
+
+/** Generic callback for all model requests, with URIs of the form
+		/<model>[/<property>][?<query>]. A single hash lookup replaces the
+		per-model libevent callbacks, which libevent searches linearly. */
+void handle_request( struct evhttp_request* req, av_t* av )
+{
+	assert(req);
+	assert(av);
+
+	// split the path into model name and property
+	const char* name = req->uri[0] == '/' ? req->uri + 1 : req->uri;
+	const size_t namelen = strcspn( name, "/?" );
+	
+	const char* prop = name + namelen;
+	size_t proplen = 0;
+	if( *prop == '/' )
+		{
+			prop++;
+			proplen = strcspn( prop, "/?" );
+		}
+	
+	_av_node_t* node = NULL;
+	HASH_FIND( hh, av->tree, name, namelen, node );
+	
+	if( node == av->root && prop_is( prop, proplen, "fiducials" ) )
+		{
+			handle_fiducials( req, av, prop + proplen );
+			return;
+		}
+	
+	// the root has no simulator handle, so only its explicitly
+	// installed callbacks apply
+	if( node == NULL || node == av->root )
+		{
+			reply_error( av, req, HTTP_NOTFOUND, "not found" );
+			return;
+		}
+	
+	if( proplen == 0 )
+		handle_summary( req, node );
+	else if( prop_is( prop, proplen, "pva" ) )
+		handle_pva( req, node );
+	else if( prop_is( prop, proplen, "geom" ) )
+		handle_geom( req, node );
+	else if( prop_is( prop, proplen, "data" ) )
+		{
+			// optional reduction, e.g. /name/data/min
+			const char* op = prop + proplen;
+			size_t oplen = 0;
+			if( *op == '/' )
+				{
+					op++;
+					oplen = strcspn( op, "/?" );
+				}
+			
+			if( oplen == 0 )
+				handle_data( req, node, AV_REDUCE_NONE );
+			else if( prop_is( op, oplen, "min" ) )
+				handle_data( req, node, AV_REDUCE_MIN );
+			else if( prop_is( op, oplen, "nearest" ) )
+				handle_data( req, node, AV_REDUCE_NEAREST );
+			else if( prop_is( op, oplen, "histogram" ) )
+				handle_data( req, node, AV_REDUCE_HISTOGRAM );
+			else
+				reply_error( av, req, HTTP_NOTFOUND, "unknown data reduction" );
+		}
+	else if( prop_is( prop, proplen, "cfg" ) )
+		handle_cfg( req, node );
+	else if( prop_is( prop, proplen, "tree" ) )
+		reply_tree( av, req, node );
+	else
+		reply_error( av, req, HTTP_NOTFOUND, "unknown model property" );
+}
+
+void print_table( av_t* av )
 {
 	_av_node_t *s;
-	for(s=_tree; s; s=s->hh.next) 
+	for(s=av->tree; s; s=s->hh.next) 
 		{
 			printf("key/id: %s interface: %u children: [ ", s->id, s->interface );
 			
-			char** p = NULL;
-			while ( (p=(char**)utarray_next(s->children,p))) 
-				printf("%s ",*p);
+			uint32_t* c = NULL;
+			while ( s->children && (c=(uint32_t*)utarray_next(s->children,c))) 
+				printf("%s ", _av_node_at(av,*c)->id );
 
 			puts("]");
 		}
 }
 
-void tree_insert_model( const char* name, 
-												const char* prototype,
-												av_interface_t interface,
-												const char* parent_name )
+// the string arena is a list of blocks, newest first. Strings are
+// never freed individually, only all together in av_fini().
+typedef struct _av_arena_block
 {
-	assert(name);
+	struct _av_arena_block* next;
+	size_t used, cap;
+	char data[];
+} _av_arena_block_t;
+
+/** Copy [str] into the string arena. The copy lives until av_fini(). */
+char* arena_strdup( av_t* av, const char* str )
+{
+	const size_t len = strlen(str) + 1;
+	_av_arena_block_t* b = av->arena;
+
+	if( b == NULL || b->cap - b->used < len )
+		{
+			const size_t cap = len > AV_ARENA_BLOCK_SIZE ? len : AV_ARENA_BLOCK_SIZE;
+			_av_arena_block_t* nb = malloc( sizeof(_av_arena_block_t) + cap );
+			assert(nb);
+			nb->used = 0;
+			nb->cap = cap;
+			
+			if( b && cap == len ) // oversized string: keep filling the current block
+				{
+					nb->next = b->next;
+					b->next = nb;
+				}
+			else
+				{
+					nb->next = b;
+					av->arena = nb;
+				}
+			b = nb;
+		}
+	
+	char* copy = b->data + b->used;
+	memcpy( copy, str, len );
+	b->used += len;
+	return copy;
+}
+
+/** Returns the single arena copy of [str], creating it if needed, so
+		that repeated strings such as prototypes are stored once. */
+const char* intern( av_t* av, const char* str )
+{
+	_av_intern_t* e = NULL;
+	HASH_FIND_STR( av->interned, str, e );
+	if( e )
+		return e->str;
+	
+	e = malloc( sizeof(_av_intern_t) );
+	assert(e);
+	e->str = arena_strdup( av, str );
+	HASH_ADD_KEYPTR( hh, av->interned, e->str, strlen(e->str), e );
+	return e->str;
+}
+
+/** Make room in the arena for [bytes] of strings in one block, so a
+		batch of names is stored contiguously. */
+void arena_reserve( av_t* av, size_t bytes )
+{
+	_av_arena_block_t* b = av->arena;
+	if( b && b->cap - b->used >= bytes )
+		return;
+
+	const size_t cap = bytes > AV_ARENA_BLOCK_SIZE ? bytes : AV_ARENA_BLOCK_SIZE;
+	_av_arena_block_t* nb = malloc( sizeof(_av_arena_block_t) + cap );
+	assert(nb);
+	nb->used = 0;
+	nb->cap = cap;
+	nb->next = b;
+	av->arena = nb;
+}
+
+/** Make sure the node pool can hold [count] more nodes without
+		further allocation. */
+void node_reserve( av_t* av, uint32_t count )
+{
+	const uint32_t blocks = 
+		(av->node_count + count + AV_NODE_BLOCK_SIZE - 1) >> AV_NODE_BLOCK_BITS;
 	
-  if( _tree == NULL ) // i.e. nothing in the tree yet
+	if( blocks > av->node_block_cap )
 		{
-			// set up the root node for the sim itself
-			bzero(&_root,sizeof(_root));
-			strncpy(_root.id,"sim",strlen("sim"));
-			strncpy(_root.prototype, _root.id, strlen(_root.id));
+			av->node_block_cap = blocks;
+			av->node_blocks = realloc( av->node_blocks, 
+																 av->node_block_cap * sizeof(_av_node_t*) );
+			assert(av->node_blocks);
+		}
 
-			_root.interface = AV_INTERFACE_SIM;
-			utarray_new( _root.children, &ut_str_icd ); // initialize string array 			
-			_av_node_t* rootp = &_root; // macro needs a pointer arg
-			HASH_ADD_STR( _tree, id, rootp );
-	 }
-  
-  assert( name && strlen(name) < NAME_LEN_MAX ); 
-  assert( parent_name == NULL || strlen(parent_name) < NAME_LEN_MAX ); 
+	while( av->node_block_count < blocks )
+		{
+			av->node_blocks[av->node_block_count] = malloc( AV_NODE_BLOCK_SIZE * sizeof(_av_node_t) );
+			assert(av->node_blocks[av->node_block_count]);
+			av->node_block_count++;
+		}
+}
+
+/** Allocate a zeroed node from the pool. */
+_av_node_t* node_alloc( av_t* av )
+{
+	// reuse the slot of an unregistered node if there is one
+	uint32_t* freed = (uint32_t*)utarray_back( av->free_nodes );
+	if( freed )
+		{
+			_av_node_t* node = _av_node_at( av, *freed );
+			utarray_pop_back( av->free_nodes );
+			
+			// keep the node's name storage and child array, emptied by
+			// tree_remove(), for reuse
+			char* id = node->id;
+			uint32_t id_cap = node->id_cap;
+			UT_array* children = node->children;
+			
+			bzero( node, sizeof(_av_node_t) );
+			node->index = *freed;
+			node->av = av;
+			node->id = id;
+			node->id_cap = id_cap;
+			node->children = children;
+			return node;
+		}
+
+	const uint32_t index = av->node_count;
+
+	if( (index >> AV_NODE_BLOCK_BITS) == av->node_block_count ) // pool is full
+		{
+			// grow the block table geometrically
+			if( av->node_block_count == av->node_block_cap )
+				{
+					av->node_block_cap = av->node_block_cap ? 2 * av->node_block_cap : 16;
+					av->node_blocks = realloc( av->node_blocks, 
+																		 av->node_block_cap * sizeof(_av_node_t*) );
+					assert(av->node_blocks);
+				}
+			node_reserve( av, 1 );
+		}
+	
+	_av_node_t* node = _av_node_at( av, index );
+	bzero( node, sizeof(_av_node_t) );
+	node->index = index;
+	node->av = av;
+	av->node_count++;
+	return node;
+}
+
+_av_sensor_t* sensor_of( av_t* av, const _av_node_t* node )
+{
+	if( node->interface != AV_INTERFACE_RANGER && 
+			node->interface != AV_INTERFACE_FIDUCIAL )
+		return NULL;
+
+	_av_sensor_t* sensor = NULL;
+	HASH_FIND( hh, av->sensors, &node->index, sizeof(node->index), sensor );
+	return sensor;
+}
+
+// free [sensor]'s caches and the entry itself
+static void sensor_free( av_t* av, _av_sensor_t* sensor )
+{
+	HASH_DEL( av->sensors, sensor );
+	for( uint32_t t=0; t<sensor->beams_count; t++ )
+		free( sensor->beams[t].beam );
+	free( sensor->beams );
+	if( sensor->seen_ids )
+		utarray_free( sensor->seen_ids );
+	free( sensor );
+}
+
+void tree_init( av_t* av )
+{
+	utarray_new( av->free_nodes, &_av_index_icd );
+
+	// set up the root node for the sim itself
+	_av_node_t* rootp = node_alloc( av ); // macro needs a pointer arg
+	assert( rootp->index == AV_ROOT_INDEX );
+	
+	rootp->id = arena_strdup( av, "sim" );
+	rootp->prototype = intern( av, "sim" );
+	rootp->interface = AV_INTERFACE_SIM;
+	rootp->parent = AV_ROOT_INDEX;
+	
+	HASH_ADD_KEYPTR( hh, av->tree, rootp->id, strlen(rootp->id), rootp );
+	av->root = rootp;
+}
+
+void tree_fini( av_t* av )
+{
+	HASH_CLEAR( hh, av->tree );
+
+	for( uint32_t i=0; i<av->node_count; i++ )
+		if( _av_node_at(av,i)->children )
+			utarray_free( _av_node_at(av,i)->children );
+
+	while( av->sensors )
+		sensor_free( av, av->sensors );
+	
+	for( uint32_t b=0; b<av->node_block_count; b++ )
+		free( av->node_blocks[b] );
+	free( av->node_blocks );
+	utarray_free( av->free_nodes );
+
+	_av_intern_t *e, *tmp;
+	HASH_ITER( hh, av->interned, e, tmp )
+		{
+			HASH_DEL( av->interned, e );
+			free( e );
+		}
+
+	while( av->arena )
+		{
+			_av_arena_block_t* next = av->arena->next;
+			free( av->arena );
+			av->arena = next;
+		}
+}
+
+/** Append [node] to [parent]'s children array, creating it if this is
+		the first child, as most models are leaves. */
+void tree_attach( av_t* av, _av_node_t* parent, _av_node_t* node )
+{
+	if( parent->children == NULL )
+		utarray_new( parent->children, &_av_index_icd );
+
+	node->parent = parent->index;
+	node->child_slot = utarray_len( parent->children );
+	utarray_push_back( parent->children, &node->index );
+}
+
+_av_node_t* tree_insert_model( av_t* av,
+															 const char* name, 
+															 const char* prototype,
+															 av_interface_t interface,
+															 const char* parent_name )
+{
+	assert(av);
+	assert(name);
+	assert(prototype);
+	
+  // find the parent first so a bad name leaves the tree untouched
+  _av_node_t *parent_node = NULL;
   
+  if( parent_name )
+	 HASH_FIND_STR( av->tree, parent_name, parent_node );
+  else
+		parent_node = av->root;
+
+	if( parent_node == NULL )
+		{
+			printf( "[Avon] error: parent \"%s\" of model \"%s\" not found\n", 
+							parent_name, name );
+			return NULL;
+		}
+
+	_av_node_t *node = NULL;
+	HASH_FIND_STR( av->tree, name, node );
+	if( node )
+		{
+			printf( "[Avon] error: model \"%s\" already registered\n", name );
+			return NULL;
+		}
+
   // insert this new node into the tree
-  
-  _av_node_t *node = malloc( sizeof(_av_node_t));
-  assert(node);
-  bzero(node,sizeof(_av_node_t));
-  
-  strncpy(node->id,name,NAME_LEN_MAX);
+  node = node_alloc( av );
+
+	// names are unique, so no need to intern. A reused slot keeps its
+	// old name storage if the new name fits.
+	const size_t len = strlen(name) + 1;
+	if( len <= node->id_cap )
+		memcpy( node->id, name, len );
+	else
+		{
+			node->id = arena_strdup( av, name ); 
+			node->id_cap = len;
+		}
+
+	node->prototype = intern( av, prototype );
 	node->interface = interface;
-	strncpy( node->prototype, prototype, strlen(prototype));
-  utarray_new( node->children, &ut_str_icd ); // initialize string array 
   
   // add the node to the tree, keyed on the name  
-  HASH_ADD_STR( _tree, id, node );
+  HASH_ADD_KEYPTR( hh, av->tree, node->id, strlen(node->id), node );
   
-  // did something happen?
-  assert( _tree != NULL );
-  
-  // add the child to the parent  
-  _av_node_t *parent_node = NULL;
-  
-  if( parent_name )
-	 HASH_FIND_STR( _tree, parent_name, parent_node );
-  else
-		parent_node = &_root;
+	tree_attach( av, parent_node, node );
 
-  assert( parent_node );
-  
-  utarray_push_back( parent_node->children, &name );
+	if( interface == AV_INTERFACE_RANGER || interface == AV_INTERFACE_FIDUCIAL )
+		{
+			_av_sensor_t* sensor = calloc( 1, sizeof(_av_sensor_t) );
+			assert(sensor);
+			sensor->node = node->index;
+			HASH_ADD( hh, av->sensors, node, sizeof(sensor->node), sensor );
+			if( interface == AV_INTERFACE_FIDUCIAL )
+				fiducials_register( av, node );
+		}
+
+	node->pose_changed = 1; // compute our world pose at the next tick
+	av->order_dirty = 1;
+
+	return node;
+}
+
+/** Detach [node] from its parent's children array in constant time,
+		by moving the last child into its slot. */
+void tree_detach( av_t* av, _av_node_t* node )
+{
+	_av_node_t* parent = _av_node_at( av, node->parent );
+	UT_array* siblings = parent->children;
+	
+	uint32_t last = *(uint32_t*)utarray_back( siblings );
+	if( last != node->index )
+		{
+			*(uint32_t*)utarray_eltptr( siblings, node->child_slot ) = last;
+			_av_node_at( av, last )->child_slot = node->child_slot;
+		}
+	utarray_pop_back( siblings );
+}
+
+/** Remove [node] and its subtree from the tree, putting their slots on
+		the free list. */
+void tree_remove( av_t* av, _av_node_t* node )
+{
+	assert( node != av->root );
+
+	// children first, from the back so no siblings need moving
+	uint32_t* c;
+	while( node->children && (c = (uint32_t*)utarray_back( node->children )) )
+		tree_remove( av, _av_node_at( av, *c ) );
+	
+	tree_detach( av, node );
+	HASH_DEL( av->tree, node );
+	spatial_remove( av, node );
+	if( node->interface == AV_INTERFACE_FIDUCIAL )
+		fiducials_unregister( av, node ); // proportional to its own sightings
+	schedule_remove( av, node );
+	federation_dr_clear( av, node );
+
+	_av_sensor_t* sensor = sensor_of( av, node );
+	if( sensor )
+		sensor_free( av, sensor );
+	
+	node->parent = AV_NODE_FREE;
+	node->handle = NULL;
+	av->order_dirty = 1;
+	utarray_push_back( av->free_nodes, &node->index );
 }
 
 
-int av_register_model( const char* name, 
+int av_register_model( av_t* av,
+											 const char* name, 
 											 const char* prototype,
 											 av_interface_t interface, 
 											 const char* parent_name, 
 											 void* handle )
 {
-  if( _av.verbose) 
+  if( av->verbose) 
 	 printf( "[Avon] registering \"%s\" child of \"%s\"\n", name, parent_name );
   
-  tree_insert_model( name, prototype, interface, parent_name );
+  _av_node_t* node = tree_insert_model( av, name, prototype, interface, parent_name );
+	if( node == NULL )
+		return -1; // error
+	node->handle = handle;
 
-  // now install callbacks for this node
-
-  char buf[256];
-  
-	// PVA requests
-  snprintf( buf, 256, "/%s/pva", name );
-  evhttp_set_cb( _av.eh, buf, (evhttp_cb_t)handle_pva, handle );
-	
-	// geometry requests
-  snprintf( buf, 256, "/%s/geom", name );
-  evhttp_set_cb( _av.eh, buf, (evhttp_cb_t)handle_geom, handle );
-  
-	// data requests
-  interface_handle_pair_t* ihp = malloc(sizeof(ihp));
-  assert(ihp);
-  ihp->interface = interface;
-  ihp->handle = handle;
-  
-  snprintf( buf, 256, "/%s/data", name );
-  evhttp_set_cb( _av.eh, buf, (evhttp_cb_t)handle_data, ihp );
-	
-	// everything requests (no property name)
-	snprintf( buf, 256, "/%s", name );
-  evhttp_set_cb( _av.eh, buf, (evhttp_cb_t)handle_summary, ihp );
-	
-/*   snprintf( buf, 256, "/%s/cmd", name ); */
-/*   evhttp_set_cb( av->eh, buf, (evhttp_cb_t)handle_cmd[interface], ihp ); */
-  
-  snprintf( buf, 256, "/%s/cfg", name ); 
-  evhttp_set_cb( _av.eh, buf, (evhttp_cb_t)handle_cfg, ihp );	 
+	// requests for this model's properties are routed by
+	// handle_request(), so there are no per-model callbacks to install
   
-	//print_table();
+	//print_table( av );
 
-	//char* xdr = xdr_tree( NULL );
+	//char* xdr = xdr_tree( av, NULL, -1, 0 );
 	//printf( "xdr: %s\n", xdr );
 	//free(xdr);
 
 	return 0; // ok
 }
 
+int av_unregister_model( av_t* av, const char* name )
+{
+	assert(av);
+	assert(name);
+
+	if( av->verbose) 
+		printf( "[Avon] unregistering \"%s\"\n", name );
+
+	_av_node_t* node = NULL;
+	HASH_FIND_STR( av->tree, name, node );
+	if( node == NULL || node == av->root )
+		{
+			printf( "[Avon] error: can't unregister unknown model \"%s\"\n", name );
+			return -1;
+		}
+	
+	tree_remove( av, node );
+	return 0; //ok
+}
+
+int av_reparent_model( av_t* av, const char* name, const char* parent_name )
+{
+	assert(av);
+	assert(name);
+
+	_av_node_t* node = NULL;
+	HASH_FIND_STR( av->tree, name, node );
+	
+	_av_node_t* parent_node = NULL;
+	if( parent_name )
+		HASH_FIND_STR( av->tree, parent_name, parent_node );
+	else
+		parent_node = av->root;
+	
+	if( node == NULL || node == av->root || parent_node == NULL )
+		{
+			printf( "[Avon] error: can't reparent \"%s\" to \"%s\"\n", 
+							name, parent_name );
+			return -1;
+		}
+	
+	// refuse to create a cycle by moving a model below itself
+	for( _av_node_t* n = parent_node; n != av->root; n = _av_node_at( av, n->parent ) )
+		if( n == node )
+			{
+				printf( "[Avon] error: can't reparent \"%s\" to its own descendant \"%s\"\n", 
+								name, parent_name );
+				return -1;
+			}
+	
+	tree_detach( av, node );
+	tree_attach( av, parent_node, node );
+	node->pose_changed = 1; // recompute our world pose at the next tick
+	av->order_dirty = 1;
+	return 0; //ok
+}
+
+int av_geom_changed( av_t* av, const char* name )
+{
+	assert(av);
+	assert(name);
+
+	_av_node_t* node = NULL;
+	HASH_FIND_STR( av->tree, name, node );
+	if( node == NULL || node == av->root )
+		{
+			printf( "[Avon] error: no model \"%s\" to update the geometry of\n", name );
+			return -1;
+		}
+
+	node->geom_known = 0; // refetch the radius at the next tick
+	return 0;
+}
+
+int av_tick( av_t* av )
+{
+	assert(av);
+	
+	if( av->pva_get == NULL || av->geom_get == NULL )
+		{
+			puts( "[Avon] error: generic callbacks must be installed before av_tick()" );
+			return -1;
+		}
+	
+	// hand the simulator the pva sets scheduled for this tick, before
+	// reading the poses back
+	schedule_run( av, (*av->clock_get)( av->clock_get_user ) );
+
+	// move the puppets that their owners are dead reckoning
+	federation_dead_reckon( av );
+
+	// fetch every model's pose, noting which have moved
+	_av_node_t* node;
+	for( node = av->tree; node; node = node->hh.next )
+		{
+			if( node == av->root )
+				continue;
+
+			av_pva_t pva;
+			(*av->pva_get)( node->handle, &pva );
+			if( memcmp( node->pose, pva.p, sizeof(node->pose) ) )
+				{
+					memcpy( node->pose, pva.p, sizeof(node->pose) );
+					node->pose_changed = 1;
+				}
+			
+			if( ! node->geom_known )
+				{
+					av_geom_t geom;
+					(*av->geom_get)( node->handle, &geom );
+					node->radius = 0.5 * hypot( geom.extent[0], geom.extent[1] );
+					node->geom_known = 1;
+					node->pose_changed = 1; // so the spatial index sees the radius
+					federation_sense_range( av, node );
+				}
+		}
+
+	// the fiducial id index is rebuilt when /sim/fiducials next asks
+	av->seen_dirty = 1;
+	
+	// bring the world poses and spatial index up to date
+	spatial_world_poses( av );
+
+	// then mirror models that moved into their puppets on our peers,
+	// testing where they are now against the peers' interests
+	federation_push( av );
+
+	// and tell our peers if what we can sense has changed
+	federation_interest( av );
+
+	// and, if time is synchronized, how far they may run ahead of us
+	federation_sync( av );
+
+	// and, if we partition the federation, who should simulate what
+	partition_tick( av );
+
+	// and whether a client's run of the clock is over
+	clock_tick( av );
+	
+	return 0; //ok
+}
+
+int av_set_spatial_cell_size( av_t* av, double size )
+{
+	assert(av);
+	
+	if( size <= 0 || av->cells )
+		{
+			puts( "[Avon] error: spatial cell size must be positive and set before av_tick()" );
+			return -1;
+		}
+	
+	av->cell_size = size;
+	return 0; //ok
+}
+
+int av_register_models( av_t* av, const av_model_t* models, size_t count )
+{
+	assert(av);
+	assert(models || count == 0);
+	
+	// size everything for the whole batch up front
+	size_t bytes = 0;
+	for( size_t i=0; i<count; i++ )
+		bytes += strlen( models[i].name ) + 1;
+	
+	arena_reserve( av, bytes );
+	node_reserve( av, count );
+	
+	// grow the hash table's buckets now rather than incrementally as
+	// the models are added. uthash expands when any one chain reaches
+	// HASH_BKT_CAPACITY_THRESH, so aim for about one model per bucket,
+	// leaving headroom for uneven chains.
+	UT_hash_table* tbl = av->tree->hh.tbl;
+	while( tbl->num_buckets < tbl->num_items + count )
+		HASH_EXPAND_BUCKETS( tbl );
+	
+	for( size_t i=0; i<count; i++ )
+		if( av_register_model( av, 
+													 models[i].name, 
+													 models[i].prototype,
+													 models[i].interface,
+													 models[i].parent,
+													 models[i].handle ) )
+			{
+				printf( "[Avon] error: failed to register model %lu of %lu\n", 
+								(unsigned long)i, (unsigned long)count );
+				return -1;
+			}
+	
+	return 0; //ok
+}
+
 
-int av_install_generic_callbacks( av_pva_set_t pva_set,
+int av_install_generic_callbacks( av_t* av,
+																	av_pva_set_t pva_set,
 																	av_pva_get_t pva_get, 
 																	av_geom_set_t geom_set, 
 																	av_geom_get_t geom_get )
 {
 
-  _av.pva_set = pva_set;
-  _av.pva_get = pva_get;
-  _av.geom_set = geom_set;
-  _av.geom_get = geom_get;
+  av->pva_set = pva_set;
+  av->pva_get = pva_get;
+  av->geom_set = geom_set;
+  av->geom_get = geom_get;
 
 	return 0; //ok
 }
 
-int av_install_clock_callbacks( av_clock_get_t clock_get, void* obj )
+int av_install_clock_callbacks( av_t* av, av_clock_get_t clock_get, void* obj )
+{
+	av->clock_get = clock_get;
+	av->clock_get_user = obj;
+	return 0; //ok
+}
+
+int av_install_clock_limit_callback( av_t* av, av_clock_limit_t clock_limit, void* obj )
+{
+	av->clock_limit = clock_limit;
+	av->clock_limit_user = obj;
+	return 0; //ok
+}
+
+int av_install_owner_callback( av_t* av, av_owner_set_t owner_set )
 {
-	_av.clock_get = clock_get;
-	_av.clock_get_user = obj;
+	av->owner_set = owner_set;
 	return 0; //ok
 }
 
 
-int av_install_interface_callbacks( av_interface_t interface,
+int av_install_interface_callbacks( av_t* av,
+																		av_interface_t interface,
 																		av_data_get_t data_get,
 																		av_cmd_set_t cmd_set,
 																		av_cfg_set_t cfg_set,
 																		av_cfg_get_t cfg_get )
 {
-  _av.data_get[interface] = data_get;
-  _av.cmd_set[interface] = cmd_set;
-  _av.cfg_set[interface] = cfg_set;
-  _av.cfg_get[interface] = cfg_get;	
+  av->data_get[interface] = data_get;
+  av->cmd_set[interface] = cmd_set;
+  av->cfg_set[interface] = cfg_set;
+  av->cfg_get[interface] = cfg_get;	
   
 	return 0; //ok
 }
@@ -115,6 +115,16 @@ typedef struct
 	 av_bounds_t fov[3];	 
 } av_fiducial_cfg_t;
 
+/* GET /name/data?format=binary on a fiducial model replies with
+	 application/octet-stream, in the server's byte order: a header of
+	 uint64_t time (usec), uint32_t fiducial_count and uint32_t type,
+	 then fiducial_count records of uint64_t id, pose[3], geom.pose[6]
+	 and geom.extent[3]. The numbers are in the simulator's own
+	 precision: float if [type] is AV_ELEMENT_FLOAT, else double. */
+#define AV_FIDUCIAL_PACKED_HEADER 16
+#define AV_FIDUCIAL_PACKED_FLOAT_SIZE 56
+#define AV_FIDUCIAL_PACKED_DOUBLE_SIZE 104
+
 //- RANGER --------------------------------------------------
 
 #define AV_RANGER_TRANSDUCERS_MAX 64
@@ -174,14 +184,93 @@ typedef struct
   
 } av_ranger_cfg_t;
 
+//- STRIDED VIEWS --------------------------------------------
+
+/* Instead of filling the fixed-size structs above, a simulator can
+	 describe sensor data where it already lies in its own buffers, and
+	 Avon serializes straight from there. The buffers must stay valid
+	 until the data_get callback is next called. */
+
+/** type of the numbers in a strided view */
+typedef enum
+	{
+		AV_ELEMENT_DOUBLE = 0,
+		/** single precision, e.g. a lidar's native float32 ranges */
+		AV_ELEMENT_FLOAT
+	} av_element_t;
+
+/** single-precision version of av_fiducial_t, for fiducial views of
+		type AV_ELEMENT_FLOAT */
+typedef struct
+{
+	float pose[3];
+	struct
+	{
+		float pose[6];
+		float extent[3];
+	} geom;
+	uint64_t id;
+} av_fiducial_float_t;
+
+/** one ranger transducer's samples, described in place */
+typedef struct
+{
+  /** origin of the ranger beams in local coordinates (x,y,z,r,p,a) */
+  double pose[6];
+  /** number of samples to follow */
+  uint32_t sample_count;
+  /** the first sample: 4 BARI values of [type], as in
+			av_ranger_transducer_data_t, i.e. double[4] or float[4] */
+  const void* samples;
+  /** bytes from the start of one sample to the start of the next */
+  size_t stride;
+  av_element_t type;
+} av_ranger_transducer_view_t;
+
+typedef struct
+{
+	/** time of the samples in usec, or 0 to use the av_msg_t's time */
+	uint64_t time;
+  /** number of transducers to follow */
+  uint32_t transducer_count;
+  /** array of transducer_count transducer views */
+  const av_ranger_transducer_view_t* transducers;
+} av_ranger_view_t;
+
+typedef struct
+{
+	/** time of the detections in usec, or 0 to use the av_msg_t's time */
+	uint64_t time;
+	uint32_t fiducial_count;
+	/** the first detection, e.g. embedded in a simulator's own
+			record. Points to av_fiducial_t, or to av_fiducial_float_t if
+			[type] is AV_ELEMENT_FLOAT. */
+	const void* fiducials;
+	/** bytes from the start of one detection to the start of the next */
+	size_t stride;
+	av_element_t type;
+} av_fiducial_view_t;
+
 //---------------------------------------------------------
 
+/** how the data pointed to by an av_msg_t is laid out */
+typedef enum
+	{
+		/** the interface's fixed-size struct, e.g. av_ranger_data_t */
+		AV_MSG_FIXED = 0,
+		/** the interface's strided view, e.g. av_ranger_view_t */
+		AV_MSG_VIEW
+	} av_msg_layout_t;
+
 typedef struct
 {
   uint64_t time;
   av_interface_t interface;
   const void* data;
   size_t len;
+	/** Avon zeroes messages before passing them to callbacks, so this
+			is AV_MSG_FIXED unless the simulator sets it. */
+	av_msg_layout_t layout;
 } av_msg_t;
 
 typedef int (*av_pva_set_t)( void* obj, av_pva_t* pva );
@@ -196,40 +285,186 @@ typedef int (*av_cfg_get_t)( void* obj, av_msg_t* cfg );
 
 typedef uint64_t (*av_clock_get_t)(void* obj);
 
-int av_init( const char* hostname, 
-				 const uint16_t port, 
-				 const char* rootdir, 
-				 const int verbose,
-				 const char* backend_name,
-				 const char* backend_version );
+typedef void (*av_clock_limit_t)(void* obj, uint64_t limit);
+
+typedef int (*av_owner_set_t)( void* handle, int owned );
+
+/** Opaque handle to an Avon server instance. Each instance owns its
+		own model tree, callbacks, event base and port, so a process can
+		host several servers, e.g. one per partition of a large world. */
+typedef struct av av_t;
+
+/** Create a server instance. Returns NULL on failure. Release with
+		av_fini(). */
+av_t* av_init( const char* hostname, 
+							 const uint16_t port, 
+							 const char* rootdir, 
+							 const int verbose,
+							 const char* backend_name,
+							 const char* backend_version );
 
 /** Frees resources. */
-void av_fini( void );
+void av_fini( av_t* av );
 
-void av_startup( void );
+void av_startup( av_t* av );
 
 /** Handle server events. Blocks until at least one event occurs. */
-void av_wait( void );
+void av_wait( av_t* av );
 
 /** Handle server events. Returns immediately if none are pending. */
-void av_check();
-
-int av_register_model( const char* name, 
+void av_check( av_t* av );
+
+// libevent's event loop type, forward declared so that users need not
+// include libevent headers unless they integrate with it
+struct event_base;
+
+/** Attach the server to a libevent event base owned by the host,
+		instead of creating a private one in av_startup(). Must be called
+		before av_startup(). Avon's sockets and timers are then serviced
+		whenever the host runs the base with its own event_base_loop() or
+		event_base_dispatch(), so the simulator step need not call
+		av_check(). The host must keep the base alive until after
+		av_fini(). */
+int av_set_event_base( av_t* av, struct event_base* base );
+
+/** Returns the event base servicing this instance, or NULL before
+		av_startup(). */
+struct event_base* av_get_event_base( av_t* av );
+
+int av_register_model( av_t* av,
+											 const char* name, 
 											 const char* prototype,
 											 av_interface_t interface, 
 											 const char* parent, 
 											 void* handle );
 
-int av_install_clock_callbacks( av_clock_get_t clock_get, void* obj );
-
-int av_install_generic_callbacks( av_pva_set_t pva_set,
+/** Remove a model and all its descendants. Their storage is reused by
+		later registrations. Returns 0 on success, -1 if there is no such
+		model. */
+int av_unregister_model( av_t* av, const char* name );
+
+/** Move a model and its subtree to a new parent, or to the top level
+		if [parent] is NULL. The model's pva pose is in its parent's
+		coordinate system, so the simulator should update it to match.
+		Returns 0 on success, -1 on error. */
+int av_reparent_model( av_t* av, const char* name, const char* parent );
+
+/** Tell Avon that the simulator has changed a model's geometry, so
+		that its bounding radius is fetched again at the next av_tick().
+		Returns 0 on success, -1 if there is no such model. */
+int av_geom_changed( av_t* av, const char* name );
+
+/** Refresh Avon's cached model state from the simulator. Call once
+		per simulation step, after the models have moved. Keeps the
+		spatial index behind /sim/query up to date. The fiducial
+		detections behind /sim/fiducials/<id> are fetched when that is
+		next queried. Returns 0 on success, -1 on error. */
+int av_tick( av_t* av );
+
+/** Set the edge length in meters of the grid cells used to index
+		model positions. Must be called before the first av_tick(). */
+int av_set_spatial_cell_size( av_t* av, double size );
+
+/** Join the federation described in the file [filename], in the
+		format of examples/world.fed. Opens a persistent link to every
+		other server listed, without blocking. Each av_tick() then sends
+		the pva of this server's exported models that moved to their
+		puppets on those peers, pipelining many updates on each link. The
+		peers must register the puppet models. Must be called after
+		av_startup(). Returns 0 on success, -1 on error. */
+int av_load_federation( av_t* av, const char* filename );
+
+/** Repartition the federation's mirrored models among its members
+		by location every [period] seconds of simulation time, so that
+		models near each other are simulated together, with about the
+		same number on each member. A model migrates to its new owner
+		only once it is [hysteresis] meters inside the new owner's
+		region, so that one moving along a boundary does not flap. The
+		owners of models in the federation file's member sections are
+		where it starts. Enable this on one member only; the others
+		follow it. A [period] of 0 (the default) disables it. Returns 0
+		on success, -1 on error. */
+int av_set_partitioning( av_t* av, double period, double hysteresis );
+
+/** Returns 1 once the link to every peer is up, else 0. Links are
+		opened in parallel and retried with exponential backoff, so a
+		server can keep calling av_check() until this is true, whatever
+		order the federation's servers were started in. */
+int av_federation_ready( av_t* av );
+
+/** Mirror exported models by dead reckoning. Peers extrapolate each
+		puppet from the last pva sent, and an update is sent only when
+		the extrapolated pose is more than [position] meters or [angle]
+		radians from the model's real pose. A threshold of 0 is not
+		checked, and with both 0 (the default) every change is
+		sent. Returns 0 on success, -1 on error. */
+int av_set_dead_reckoning( av_t* av, double position, double angle );
+
+/** Synchronize simulation time across the federation
+		conservatively. Each server advertises its clock plus [lookahead]
+		usec, a window in which it promises not to affect its peers, and
+		may itself run only up to the earliest of its peers' windows: see
+		av_safe_time(). A new window is advertised only once half of the
+		last one has been used, so the time step between av_tick() calls
+		must be shorter than [lookahead]. Every member of the federation
+		must enable this. A [lookahead] of 0 (the default) disables
+		it. Returns 0 on success, -1 on error. */
+int av_set_lookahead( av_t* av, uint64_t lookahead );
+
+/** Returns the simulation time up to which this server may run
+		without overtaking any peer, or UINT64_MAX if time is not
+		synchronized. A client's POST to /sim/clock to run for a while
+		or by steps bounds it too. A simulator waiting for it should keep
+		calling av_check(). */
+uint64_t av_safe_time( av_t* av );
+
+/** Description of one model, for registering many at once with
+		av_register_models(). */
+typedef struct
+{
+	const char* name;
+	const char* prototype;
+	av_interface_t interface;
+	const char* parent; ///< NULL for a top-level model
+	void* handle;
+} av_model_t;
+
+/** Register [count] models in one call, allocating storage for all of
+		them up front. A model's parent must already be registered or
+		appear earlier in the array. Returns 0 on success, or -1 at the
+		first model that fails to register. */
+int av_register_models( av_t* av, const av_model_t* models, size_t count );
+
+int av_install_clock_callbacks( av_t* av, av_clock_get_t clock_get, void* obj );
+
+/** Optional: [clock_limit] is called with the new av_safe_time()
+		whenever a peer's lookahead window lets it advance, or a run
+		set by POST /sim/clock starts or ends, so that an event-driven
+		simulator can run up to it. */
+int av_install_clock_limit_callback( av_t* av, av_clock_limit_t clock_limit, void* obj );
+
+/** Returns the sim time of the earliest pva set waiting to be
+		applied, or UINT64_MAX if there is none. A POST to /name/pva?at=<usec>
+		is held until the first av_tick() at or after that sim time, so a
+		simulator with variable steps can end a step there to apply it
+		exactly. */
+uint64_t av_scheduled_next( av_t* av );
+
+/** Install the callback telling the simulator that it now simulates
+		the model [handle], if [owned], or that the model has become a
+		puppet driven by its new owner. Every member must install it for
+		models to migrate: see av_set_partitioning(). */
+int av_install_owner_callback( av_t* av, av_owner_set_t owner_set );
+
+int av_install_generic_callbacks( av_t* av,
+																	av_pva_set_t pva_set,
 																	av_pva_get_t pva_get, 
 																	av_geom_set_t geom_set, 
 																	av_geom_get_t geom_get );
 
-int av_install_interface_callbacks( av_interface_t interface,
+int av_install_interface_callbacks( av_t* av,
+																		av_interface_t interface,
 																		av_data_get_t data_get,
 																		av_cmd_set_t cmd_set,
 																		av_cfg_set_t cfg_set,
 																		av_cfg_get_t cfg_get );
-
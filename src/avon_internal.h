@@ -4,21 +4,518 @@
 #include "uthash-1.9.2/src/uthash.h"
 #include "uthash-1.9.2/src/utstring.h"
 
-// static allocation for model names makes the code very simple, but
-// will fail/crash if names exceed these lengths
-#define NAME_LEN_MAX 512
-#define TYPE_LEN_MAX 512
+// nodes are allocated in fixed-size blocks so that their addresses
+// are stable (uthash links them by pointer) and their indices are
+// compact. Block size is 2^AV_NODE_BLOCK_BITS nodes.
+#define AV_NODE_BLOCK_BITS 10
+#define AV_NODE_BLOCK_SIZE (1<<AV_NODE_BLOCK_BITS)
 
-// not for users
+// strings are copied into arena blocks of at least this many bytes
+#define AV_ARENA_BLOCK_SIZE 65536
+
+// the root node is always the first node allocated
+#define AV_ROOT_INDEX 0
+
+// parent index marking a node that is on the free list
+#define AV_NODE_FREE UINT32_MAX
+
+// default edge length of a spatial index cell, in meters
+#define AV_SPATIAL_CELL_SIZE 2.0
+
+// most requests written to a peer link before its replies come back
+#define AV_PEER_PIPELINE_MAX 64
+
+/* POST /sim/puppets carries the pva of many puppets in one
+	 application/octet-stream frame, in the sender's byte order: a
+	 header of uint32_t AV_PUPPET_FRAME_MAGIC and uint32_t count, then
+	 count unaligned records of double pva[18] (p, v, a), uint16_t name
+	 length and uint8_t flags, followed by the name unterminated. */
+#define AV_PUPPET_FRAME_MAGIC 0x41565046 // "AVPF", to catch byte order mismatches
+#define AV_PUPPET_FRAME_HEADER 8
+#define AV_PUPPET_RECORD_SIZE (18*8 + 2 + 1)
+#define AV_PUPPET_DR 1 /* record flag: extrapolate it, the sender is dead reckoning */
+
+// usec to wait before reconnecting to a peer, doubling after each
+// failure up to the maximum
+#define AV_PEER_BACKOFF_MIN 50000
+#define AV_PEER_BACKOFF_MAX 2000000
+
+// meters by which regions of interest are widened, so that they are
+// resent to peers only after a sensor has moved half this far
+#define AV_INTEREST_MARGIN 1.0
+
+// not for users. State that only some models need, e.g. a sensor's
+// caches, is kept in side tables keyed by node index, so that this
+// stays small for worlds of many plain models.
 typedef struct {
-  char id[NAME_LEN_MAX];  /* model name and hash table key */          
-	char prototype[NAME_LEN_MAX]; /* clue to clients about what kind of
-																	 object this is.*/
+  char* id;  /* model name in the string arena, and hash table key */          
+	const char* prototype; /* interned clue to clients about what kind of
+														object this is.*/
 	av_interface_t interface; /* specifies which message handlers are
 															 called for this model */
+	uint32_t index; /* our position in the node pool */
+	uint32_t parent; /* index of our parent node, or AV_NODE_FREE */
+	uint32_t child_slot; /* our position in our parent's children array */
+	uint32_t id_cap; /* bytes available at id, reused when the slot is */
+	uint8_t geom_known; /* non-zero once radius has been fetched, and
+												 cleared when the geometry changes */
+	uint8_t pose_changed; /* pose changed at this tick (or is new) */
+	uint8_t world_changed; /* world pose changed at this tick */
+	uint8_t dead_reckoned; /* non-zero if we have an entry in av->dr */
+  UT_array* children; /* indices of our children, or NULL until we have one */
+	struct av* av; /* the server instance that owns this node */
+	void* handle; /* simulator's model handle, passed back to callbacks */
+	double pose[6]; /* pose at the last av_tick(), in parent's CS */
+	double world[6]; /* pose at the last av_tick(), in the world CS */
+	double radius; /* radius of the xy bounding circle of our extent */
   UT_hash_handle hh; /* makes this structure hashable */
-  UT_array* children; /* array of strings naming our children */
 } _av_node_t;
 
+// a ranger or fiducial model's sensing state, in av->sensors
+typedef struct {
+	uint32_t node; /* index of the model, and hash table key */
+	struct _av_beams* beams; /* cached ranger beam directions, per transducer */
+	uint32_t beams_count; /* number of transducers in beams */
+	UT_array* seen_ids; /* fiducial ids we detected at the last av_tick() */
+	uint32_t fiducial_slot; /* our position in av->fiducials, if a fiducial model */
+	double sense_range; /* furthest our sensors see, or 0 if unknown */
+	UT_hash_handle hh;
+} _av_sensor_t;
+
+// the last pva from a dead reckoning peer for one puppet, in av->dr
+typedef struct {
+	uint32_t node; /* index of the puppet, and hash table key */
+	av_pva_t pva;
+	uint64_t time; /* our clock when pva arrived */
+	UT_hash_handle hh;
+} _av_dr_t;
+
+// where a model is in the spatial index, in av->cell_refs by node index
+typedef struct {
+	struct _av_cell* cell; /* the cell we are in, or NULL */
+	uint32_t slot; /* our position in the cell's member array */
+} _av_cell_ref_t;
+
+// a spatial index cell: the models whose positions fall in one square
+// of the grid
+typedef struct _av_cell {
+	int64_t key; /* packed grid coordinates, and hash table key */
+	UT_array* members; /* indices of the models in this cell */
+	UT_hash_handle hh;
+} _av_cell_t;
+
+// unit vector of one ranger beam in the transducer's CS, cached so
+// that fixed-fov scanners do not recompute the trig every scan
+typedef struct {
+	double bearing, azimuth; /* the angles dir was computed for */
+	double dir[3];
+} _av_beam_t;
+
+typedef struct _av_beams {
+	uint32_t cap;
+	_av_beam_t* beam;
+} _av_beams_t;
+
+// one model's detection of a fiducial
+typedef struct {
+	uint32_t node; /* index of the observing model */
+	double pose[3]; /* detection pose, as in av_fiducial_t */
+} _av_sighting_t;
+
+// inverted index entry: every model currently detecting fiducial [id]
+typedef struct {
+	uint64_t id; /* hash table key */
+	UT_array* sightings; /* of _av_sighting_t */
+	UT_hash_handle hh;
+} _av_seen_t;
+
+// elements of a view widened to double at a time, bounding stack use
+#define AV_ELEMENT_BLOCK 64
+
+// one fiducial detection, whatever its element type
+typedef struct {
+  uint64_t id;
+  double pose[3];
+  double geom_pose[6];
+  double geom_extent[3];
+} _av_fiducial_rec_t;
+
+// a disc in the world xy plane, e.g. a region some sensor can see
+typedef struct {
+	double x, y, r;
+} _av_circle_t;
+
+static const UT_icd _av_circle_icd = { sizeof(_av_circle_t), NULL, NULL, NULL };
+
+// a link to another Avon server in the federation
+typedef struct _av_peer {
+	struct av* av; /* the server this link belongs to */
+	char* name; /* logical name from the federation file, and hash key */
+	char* host;
+	uint16_t port;
+	struct addrinfo* addr; /* host:port, resolved once when loaded */
+	int fd; /* socket, or -1 if not connected */
+	int connected; /* non-zero once the connect has completed */
+	struct event* rd; /* read and write events on fd */
+	struct event* wr;
+	struct evbuffer* in; /* bytes read but not yet parsed */
+	struct evbuffer* out; /* requests not yet written */
+	struct event* retry; /* timer to reconnect after a failure */
+	uint32_t backoff; /* usec to wait before the next reconnect */
+	struct evbuffer* frame; /* puppet records for this tick's frame */
+	uint32_t frame_count;
+	int frame_relay; /* non-zero if the frame holds records for peers beyond it */
+	const char* frame_last; /* interned model of the last record, so each goes once */
+	struct _av_peer* parent; /* the peer relaying our updates to it, or NULL */
+	int relay_child; /* non-zero if we relay updates to it */
+	struct _av_peer* via; /* where we send its updates: itself or a relay */
+	uint32_t hops; /* links from us to it along the relay tree */
+	uint64_t sent_at[AV_PEER_PIPELINE_MAX]; /* wall clock usec of requests in flight */
+	uint32_t sent_head; /* index in sent_at of the oldest */
+	uint64_t rtt; /* smoothed usec from request to reply */
+	uint32_t in_flight; /* requests written, replies not yet read */
+	uint64_t sent, acked, failed; /* request counts, for /sim/federation */
+	UT_array* interest; /* _av_circle_t regions the peer can sense, or NULL
+												 if it has not told us, so it gets everything */
+	uint64_t grant; /* the peer's clock plus lookahead: we may run up to it */
+	uint64_t grant_sent; /* the grant we last sent the peer, or 0 */
+	UT_hash_handle hh;
+} _av_peer_t;
+
+// a local model whose pva is mirrored into a puppet on a peer
+typedef struct {
+	const char* model; /* interned name of the local model */
+	const char* prototype; /* interned hint about the puppet's kind */
+	_av_peer_t* peer;
+	int sent_valid; /* non-zero once an update has been sent */
+	av_pva_t sent; /* the last update sent, which the peer extrapolates */
+	uint64_t sent_time; /* our clock when it was sent */
+} _av_puppet_t;
+
+// which member of the federation simulates a mirrored model
+typedef struct {
+	const char* model; /* interned name, and hash table key */
+	const char* owner; /* interned name of the member simulating it */
+	const char* prototype; /* interned hint about its puppets' kind */
+	UT_array* mirrors; /* interned names of the members with a puppet of it */
+	UT_hash_handle hh;
+} _av_owner_t;
+
+// where the partitioner would place one mirrored model
+typedef struct {
+	_av_owner_t* own;
+	double x, y; /* world position */
+	double margin; /* meters from the nearest boundary between members */
+	const char* proposed; /* interned name of the member it belongs to */
+	int migrate; /* non-zero if it is far enough inside to move there */
+} _av_placement_t;
+
+typedef struct {
+	_av_placement_t* items;
+	uint32_t count;
+	const char** members; /* interned member names, sorted */
+	uint32_t member_count;
+} _av_partition_t;
+
+// a pva set held until its target sim time
+typedef struct {
+	uint64_t at; /* sim time usec to apply it, and heap key */
+	uint64_t seq; /* arrival order, to break ties */
+	uint32_t node; /* index of the node to set */
+	int dr; /* non-zero if from a dead reckoning peer */
+	av_pva_t pva;
+} _av_scheduled_t;
+
+// the sets waiting for one model, in av->pending
+typedef struct {
+	uint32_t node; /* index of the model, and hash table key */
+	uint32_t count; /* sets in the heap for it */
+	uint64_t first_seq; /* seq of the first: earlier ones are for a model
+												 that was removed from this slot */
+	UT_hash_handle hh;
+} _av_pending_t;
+
+// a POST /sim/clock awaiting the end of its run
+typedef struct {
+	struct evhttp_request* req;
+	uint64_t t0; /* the client's wall clock usec when it sent req, or 0 */
+	uint64_t t1; /* our wall clock usec when req arrived */
+} _av_clock_waiter_t;
+
+static const UT_icd _av_clock_waiter_icd = { sizeof(_av_clock_waiter_t), NULL, NULL, NULL };
+
+// interned string table entry
+typedef struct {
+	const char* str; /* string in the arena, and hash table key */
+	UT_hash_handle hh;
+} _av_intern_t;
+
+// model properties that a request can select with ?fields=
+enum
+	{
+		AV_FIELD_PVA  = 1<<0,
+		AV_FIELD_GEOM = 1<<1,
+		AV_FIELD_DATA = 1<<2,
+		AV_FIELD_CFG  = 1<<3
+	};
+
+// coordinate frames a ranger reply can be expressed in
+enum
+	{
+		AV_FRAME_SENSOR = 0, // spherical BARI samples, as supplied
+		AV_FRAME_LOCAL, // cartesian points in the model's CS
+		AV_FRAME_WORLD // cartesian points in the world CS
+	};
+
+// reductions a /name/data/<op> query can ask for instead of samples
+enum
+	{
+		AV_REDUCE_NONE = 0,
+		AV_REDUCE_MIN, // minimum range per angular sector
+		AV_REDUCE_NEAREST, // the single closest return
+		AV_REDUCE_HISTOGRAM // range histogram per transducer
+	};
+
+// selections from a /name/data query, applied by the data formatters
+// as they encode. A NULL selection means everything.
+typedef struct {
+	uint64_t transducers; // bit i set: include ranger transducer i
+	int transducers_set; // if 0, include every transducer, even past 64
+	uint32_t stride; // emit every stride'th sample
+	int bearing_set;
+	double bearing[2]; // [min,max] bearing of samples to include
+	int frame; // AV_FRAME_*
+	_av_node_t* node; // the model being formatted, for frame != SENSOR
+	int reduce; // AV_REDUCE_*
+	uint32_t bins; // sectors for MIN, bins for HISTOGRAM
+	double hist_max; // upper bound of the HISTOGRAM, or 0 for automatic
+	int id_set;
+	uint64_t id; // the only fiducial id to include
+	double max_range; // exclude fiducials further away, if > 0
+	int binary; // ?format=binary: packed reply instead of JSON
+} _av_data_opts_t;
+
+// icd for arrays of node indices
+static const UT_icd _av_index_icd = { sizeof(uint32_t), NULL, NULL, NULL };
+
+// per-instance server state. Users only see the opaque av_t.
+struct av
+{
+  char* hostname;
+  unsigned short port;	
+	
+	/** human-readable "host:port" to uniquely identify this instance */
+  char* hostportname; 
+	/** working web server working directory for real files, e.g. favicon.ico */
+	char* rootdir;
+	
+	char* backend_name;
+	char* backend_version;
+
+	/** libevent event base servicing this instance */
+	struct event_base* base;
+	/** non-zero if base was supplied by the host with
+			av_set_event_base(), so we must not free it */
+	int base_external;
+	/** libevent http server instance */
+  struct evhttp* eh;
+	
+	/**  controls output level - 0 is minimal, non-zero is chatty. */
+	int verbose;
+	
+	// clock callbacks
+	av_clock_get_t clock_get;
+	// user data passed to clock_get callback
+	void* clock_get_user;
+	// optional callback told when av_safe_time() advances, and its user data
+	av_clock_limit_t clock_limit;
+	void* clock_limit_user;
+
+	// generic object callbacks
+	av_pva_set_t pva_set;
+	av_pva_get_t pva_get;
+	av_geom_set_t geom_set;
+	av_geom_get_t geom_get;
+
+	// store different data/cmd/cfg callbacks for each type of model
+	av_data_get_t data_get[AV_INTERFACE_COUNT];
+	av_cmd_set_t cmd_set[AV_INTERFACE_COUNT];
+	av_cfg_get_t cfg_get[AV_INTERFACE_COUNT];
+	av_cfg_set_t cfg_set[AV_INTERFACE_COUNT];
+
+	// node pool: an array of blocks of AV_NODE_BLOCK_SIZE nodes
+	_av_node_t** node_blocks;
+	uint32_t node_block_count;
+	uint32_t node_block_cap;
+	// number of nodes allocated from the pool, including the root
+	uint32_t node_count;
+	// indices of unregistered nodes, reused before growing the pool
+	UT_array* free_nodes;
+
+	// root node of the model tree, describing the sim itself
+	_av_node_t* root;
+	// hash table handle for the model tree, keyed on model name
+	_av_node_t* tree;
+
+	// arena holding the model names and interned strings
+	struct _av_arena_block* arena;
+	// hash table of interned strings, e.g. prototypes shared by many models
+	_av_intern_t* interned;
+
+	// spatial index: hash table of occupied grid cells
+	_av_cell_t* cells;
+	// each node's place in the index, by node index
+	_av_cell_ref_t* cell_refs;
+	uint32_t cell_refs_cap;
+	// grid cell edge length in meters
+	double cell_size;
+	// largest radius of any indexed model, to widen queries by
+	double max_radius;
+
+	// node indices in topological order (parents before children),
+	// for the world pose pass
+	UT_array* order;
+	// non-zero if the tree has changed shape since order was built
+	int order_dirty;
+
+	// sensing state of ranger and fiducial models, keyed by node index
+	_av_sensor_t* sensors;
+
+	// indices of the fiducial models, whose detections feed seen
+	UT_array* fiducials;
+	// inverted index of fiducial detections, keyed by fiducial id
+	_av_seen_t* seen;
+	// non-zero if there has been an av_tick() since seen was rebuilt
+	int seen_dirty;
+
+	// federation links, keyed by logical name, and what we mirror over them
+	_av_peer_t* peers;
+	UT_array* puppets;
+	// puppets whose owner is dead reckoning them, keyed by node index
+	_av_dr_t* dr;
+	// dead reckoning error thresholds, or 0 to send every change
+	double dr_position;
+	double dr_angle;
+	// our logical name in the federation, or NULL
+	char* fed_name;
+	// the regions our sensors covered when we last told our peers
+	UT_array* interest_sent;
+	// lookahead window for time synchronization, or 0 if not synchronized
+	uint64_t lookahead;
+	// the safe time we last passed to clock_limit
+	uint64_t limit_told;
+
+	// sim time the simulator may run to, set by POST /sim/clock, or
+	// UINT64_MAX to run freely
+	uint64_t run_until;
+	// ticks the simulator may still take, if stepping, or 0
+	uint32_t run_steps;
+	// POST /sim/clock requests to reply to when the run ends
+	UT_array* clock_waiters;
+
+	// heap of _av_scheduled_t, earliest first, or NULL
+	UT_array* scheduled;
+	// arrival count of scheduled sets, to keep equal times in order
+	uint64_t scheduled_seq;
+	// sets waiting for each model, keyed by node index
+	_av_pending_t* pending;
+	// entries in scheduled for removed nodes, dropped when they surface
+	uint32_t scheduled_stale;
+
+	// owners of the mirrored models, keyed on model name
+	_av_owner_t* owners;
+	// tells the simulator when it gains or loses a model, or NULL
+	av_owner_set_t owner_set;
+	// usec between repartitions, or 0 if we don't repartition
+	uint64_t part_period;
+	// meters inside its new region a model must be to migrate
+	double part_hysteresis;
+	// our clock at the last repartition
+	uint64_t part_last;
+};
+
+/** Returns the node at [index] in the node pool. */
+static inline _av_node_t* _av_node_at( const struct av* av, uint32_t index )
+{
+	return &av->node_blocks[ index >> AV_NODE_BLOCK_BITS ][ index & (AV_NODE_BLOCK_SIZE-1) ];
+}
+
 // macro wrapper for creating new utstrings cleanly
 UT_string* uts_new(void);
+
+// spatial index, in spatial.c
+void spatial_update( struct av* av, _av_node_t* node );
+void spatial_remove( struct av* av, _av_node_t* node );
+void spatial_query( struct av* av, 
+										double x0, double y0, double x1, double y1, 
+										UT_array* found );
+void spatial_query_near( struct av* av, 
+												 double x, double y, double r,
+												 UT_array* found );
+void spatial_fini( struct av* av );
+void spatial_world_poses( struct av* av );
+void spatial_sensor_frame( const _av_node_t* node, const double pose[6], 
+													 int world, double origin[3], double rot[9] );
+_av_beam_t* spatial_beams( _av_sensor_t* sensor, uint32_t transducer, 
+													 uint32_t count );
+
+// returns the single arena copy of [str], in avon.c
+const char* intern( struct av* av, const char* str );
+
+// the sensing state of [node], or NULL if it is not a sensor, in avon.c
+_av_sensor_t* sensor_of( struct av* av, const _av_node_t* node );
+
+// wall clock usec, for timing links and the clock exchange, in avon.c
+uint64_t wall_usec( void );
+// sim time up to which a POST /sim/clock lets us run, in avon.c
+uint64_t clock_bound( struct av* av );
+
+// federation, in federation.c
+void federation_push( struct av* av );
+void federation_dead_reckon( struct av* av );
+void federation_dr_set( struct av* av, _av_node_t* node, const av_pva_t* pva );
+void federation_dr_clear( struct av* av, _av_node_t* node );
+void federation_interest( struct av* av );
+int federation_set_interest( struct av* av, const char* peer, UT_array* regions );
+void federation_sense_range( struct av* av, _av_node_t* node );
+void federation_sync( struct av* av );
+void federation_relay( struct av* av, const void* data, size_t len );
+void federation_broadcast( struct av* av, const char* path, const char* body );
+void federation_exports( struct av* av, const _av_owner_t* own );
+int federation_set_grant( struct av* av, const char* peer, 
+													uint64_t time, uint64_t lookahead );
+void federation_fini( struct av* av );
+
+// sets the pva of [node], in avon.c
+void pva_apply( struct av* av, _av_node_t* node, const av_pva_t* pva, int dr );
+
+// pva sets scheduled for a sim time, in schedule.c
+uint32_t schedule_pva( struct av* av, _av_node_t* node, uint64_t when, 
+											 const av_pva_t* pva, int dr );
+void schedule_run( struct av* av, uint64_t now );
+void schedule_remove( struct av* av, _av_node_t* node );
+void schedule_fini( struct av* av );
+
+// model ownership and partitioning, in partition.c
+void owners_add( struct av* av, const char* model, const char* owner, 
+								 const char* mirror, const char* prototype );
+_av_owner_t* owners_find( struct av* av, const char* model, size_t len );
+int owned_here( struct av* av, const _av_owner_t* own );
+int partition_apply( struct av* av, const char* model, const char* owner );
+void partition_propose( struct av* av, _av_partition_t* part );
+void partition_free( _av_partition_t* part );
+void partition_tick( struct av* av );
+void partition_fini( struct av* av );
+
+// fiducial id index, in fiducials.c
+void fiducials_update( struct av* av, _av_node_t* node, const av_msg_t* data );
+void fiducials_remove( struct av* av, _av_node_t* node );
+void fiducials_register( struct av* av, _av_node_t* node );
+void fiducials_unregister( struct av* av, _av_node_t* node );
+_av_seen_t* fiducials_lookup( struct av* av, uint64_t id );
+void fiducials_fini( struct av* av );
+
+// fiducial data access, in json.c
+void fiducial_view( const av_msg_t* d, av_fiducial_view_t* fid );
+uint32_t fiducial_block( const av_fiducial_view_t* fid, uint32_t i, 
+												 _av_fiducial_rec_t recs[AV_ELEMENT_BLOCK] );
@@ -0,0 +1,1179 @@
+/*
+  File: federation.c
+  Description: links to peer Avon servers, read from a federation file,
+  that mirror the pva of local models onto puppets in the peers
+  Version: $Id:$
+  License: LGPL v3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strdup(), strstr()
+#include <strings.h> // for strncasecmp()
+#include <ctype.h> // for isspace()
+#include <math.h> // for remainder()
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h> // for close()
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h> // for getaddrinfo()
+
+#include <event.h>
+
+#include "avon.h"
+#include "avon_internal.h"
+
+// XDR formatters, in json.c
+char* xdr_format_interest( const char*, const UT_array* );
+char* xdr_format_sync( const char*, uint64_t, uint64_t );
+
+static const UT_icd _av_puppet_icd = { sizeof(_av_puppet_t), NULL, NULL, NULL };
+
+//- FILE PARSING ---------------------------------------------------
+
+/* The federation file is a GKeyFile-style ini file, e.g.
+
+	 [federation]
+	 host:8000=master
+	 host:8001=slave1
+
+	 [master]
+	 monkey=slave1:pioneer2dx;slave2:pioneer2dx
+
+	 [relay]
+	 slave1=slave2;slave3
+
+	 [federation] maps each server's host:port to a logical name. The
+	 section named after this server lists its models to mirror, each
+	 with the peers to mirror it into and a prototype hint. The
+	 optional [relay] section arranges the peers in a fan-out tree:
+	 updates for slave2 and slave3 are sent to slave1, which forwards
+	 them, so that a master's cost does not grow with its slaves. */
+
+typedef void (*ini_fn_t)( av_t* av, const char* section,
+													char* key, char* value, void* arg );
+
+static char* trim( char* s )
+{
+	while( isspace( (unsigned char)*s ) )
+		s++;
+	char* end = s + strlen(s);
+	while( end > s && isspace( (unsigned char)end[-1] ) )
+		*--end = 0;
+	return s;
+}
+
+// calls [fn] for every key=value line in the file [text], which is modified
+static void ini_each( av_t* av, char* text, ini_fn_t fn, void* arg )
+{
+	const char* section = "";
+	for( char* line = strtok( text, "\n" ); line; line = strtok( NULL, "\n" ) )
+		{
+			line = trim( line );
+			if( *line == 0 || *line == '#' || *line == ';' )
+				continue;
+
+			if( *line == '[' )
+				{
+					char* close = strchr( line, ']' );
+					if( close )
+						{
+							*close = 0;
+							section = line + 1;
+						}
+					continue;
+				}
+
+			char* eq = strchr( line, '=' );
+			if( eq == NULL )
+				continue;
+			*eq = 0;
+			fn( av, section, trim( line ), trim( eq+1 ), arg );
+		}
+}
+
+// reads the whole of [filename], or returns NULL
+static char* read_file( const char* filename )
+{
+	FILE* f = fopen( filename, "r" );
+	if( f == NULL )
+		return NULL;
+
+	fseek( f, 0, SEEK_END );
+	const long len = ftell( f );
+	rewind( f );
+
+	char* text = malloc( len + 1 );
+	assert(text);
+	const size_t got = fread( text, 1, len, f );
+	text[got] = 0;
+	fclose( f );
+	return text;
+}
+
+//- PEER LINKS -----------------------------------------------------
+
+static void peer_close( _av_peer_t* peer )
+{
+	if( peer->fd >= 0 )
+		{
+			event_del( peer->rd );
+			event_del( peer->wr );
+			close( peer->fd );
+		}
+	free( peer->rd );
+	free( peer->wr );
+	if( peer->in )
+		evbuffer_free( peer->in );
+	if( peer->out )
+		evbuffer_free( peer->out );
+
+	peer->rd = peer->wr = NULL;
+	peer->in = peer->out = NULL;
+	peer->fd = -1;
+	peer->connected = 0;
+	peer->in_flight = 0;
+	peer->sent_head = 0;
+	peer->grant_sent = 0; // it may not have arrived, so send it again
+}
+
+/* forget what the puppets sent over [peer]'s link were sent, so that
+	 they are all sent again, moving or not */
+static void peer_forget( _av_peer_t* peer )
+{
+	UT_array* puppets = peer->av->puppets;
+	if( puppets == NULL )
+		return;
+
+	for( _av_puppet_t* pup = (_av_puppet_t*)utarray_front( puppets );
+			 pup;
+			 pup = (_av_puppet_t*)utarray_next( puppets, pup ) )
+		if( pup->peer->via == peer )
+			pup->sent_valid = 0;
+}
+
+static void peer_reconnect( int fd, short what, void* arg );
+
+/* close [peer]'s link and try again after its backoff, which doubles,
+	 so that peers started in any order find each other without a
+	 storm of connects */
+static void peer_retry( _av_peer_t* peer )
+{
+	peer_close( peer );
+	peer_forget( peer ); // the requests queued on the link are lost
+
+	struct timeval tv = { peer->backoff / 1000000, peer->backoff % 1000000 };
+	evtimer_add( peer->retry, &tv );
+
+	peer->backoff *= 2;
+	if( peer->backoff > AV_PEER_BACKOFF_MAX )
+		peer->backoff = AV_PEER_BACKOFF_MAX;
+}
+
+static void peer_lost( _av_peer_t* peer )
+{
+	printf( "[Avon] warning: lost link to peer %s (%s:%u)\n",
+					peer->name, peer->host, peer->port );
+	peer_retry( peer );
+}
+
+/* consume every complete response in the input buffer. Requests on a
+	 link are answered in order, so each completes the oldest one in
+	 flight. */
+static void peer_parse( _av_peer_t* peer )
+{
+	struct evbuffer* in = peer->in;
+
+	for(;;)
+		{
+			const char* data = (const char*)EVBUFFER_DATA(in);
+			const size_t len = EVBUFFER_LENGTH(in);
+
+			// find the end of the headers, within the bytes we have
+			size_t hdr = 0;
+			for( size_t i=3; i<len; i++ )
+				if( memcmp( data+i-3, "\r\n\r\n", 4 ) == 0 )
+					{
+						hdr = i+1;
+						break;
+					}
+			if( hdr == 0 )
+				return; // wait for more
+
+			int code = 0;
+			sscanf( data, "HTTP/%*d.%*d %d", &code );
+
+			size_t body = 0;
+			for( const char* h = data; h; )
+				{
+					if( strncasecmp( h, "Content-Length:", 15 ) == 0 )
+						body = strtoul( h+15, NULL, 10 );
+					const char* nl = memchr( h, '\n', data + hdr - h );
+					h = nl && nl+1 < data + hdr ? nl+1 : NULL;
+				}
+
+			if( len < hdr + body )
+				return; // wait for the rest of the body
+
+			if( code == 200 )
+				peer->acked++;
+			else
+				{
+					peer->failed++;
+					printf( "[Avon] warning: peer %s replied %d to a puppet update\n",
+									peer->name, code );
+				}
+
+			if( peer->in_flight )
+				{
+					// smooth the round trip time as TCP does, with gain 1/8
+					const uint64_t rtt = wall_usec() - peer->sent_at[ peer->sent_head ];
+					peer->rtt = peer->rtt ? ( 7 * peer->rtt + rtt ) / 8 : rtt;
+					peer->sent_head = ( peer->sent_head + 1 ) % AV_PEER_PIPELINE_MAX;
+					peer->in_flight--;
+				}
+			evbuffer_drain( in, hdr + body );
+		}
+}
+
+static void peer_readable( int fd, short what, void* arg )
+{
+	_av_peer_t* peer = arg;
+
+	const int n = evbuffer_read( peer->in, fd, 16384 );
+	if( n == 0 || ( n < 0 && errno != EAGAIN && errno != EINTR ) )
+		{
+			peer_lost( peer );
+			return;
+		}
+
+	peer_parse( peer );
+}
+
+static void peer_writable( int fd, short what, void* arg )
+{
+	_av_peer_t* peer = arg;
+
+	if( ! peer->connected )
+		{
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if( getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) != 0 || err )
+				{
+					// say so once, not on every retry
+					if( peer->backoff == AV_PEER_BACKOFF_MIN || peer->av->verbose )
+						printf( "[Avon] warning: can't connect to peer %s (%s:%u): %s, retrying\n",
+										peer->name, peer->host, peer->port, strerror(err) );
+					peer_retry( peer );
+					return;
+				}
+			if( peer->av->verbose )
+				printf( "[Avon] connected to peer %s (%s:%u)\n", peer->name, peer->host, peer->port );
+			peer->connected = 1;
+			peer->backoff = AV_PEER_BACKOFF_MIN;
+
+			// the peer may have restarted, losing its puppets' state
+			peer_forget( peer );
+		}
+
+	if( EVBUFFER_LENGTH( peer->out ) && 
+			evbuffer_write( peer->out, fd ) < 0 && errno != EAGAIN && errno != EINTR )
+		{
+			peer_lost( peer );
+			return;
+		}
+
+	if( EVBUFFER_LENGTH( peer->out ) )
+		event_add( peer->wr, NULL );
+}
+
+/* start a non-blocking connect to [peer]. Requests queued before it
+	 completes are sent when it does. */
+/* start a non-blocking connect to [peer]'s address, which was
+	 resolved when it was loaded, so reconnecting never blocks on DNS */
+static int peer_connect( av_t* av, _av_peer_t* peer )
+{
+	const struct addrinfo* res = peer->addr;
+	peer->fd = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
+	if( peer->fd < 0 )
+		return -1;
+	fcntl( peer->fd, F_SETFL, fcntl( peer->fd, F_GETFL ) | O_NONBLOCK );
+
+	const int r = connect( peer->fd, res->ai_addr, res->ai_addrlen );
+	if( r != 0 && errno != EINPROGRESS )
+		{
+			close( peer->fd );
+			peer->fd = -1;
+			return -1;
+		}
+
+	peer->in = evbuffer_new();
+	peer->out = evbuffer_new();
+	peer->rd = malloc( sizeof(struct event) );
+	peer->wr = malloc( sizeof(struct event) );
+	assert( peer->in && peer->out && peer->rd && peer->wr );
+
+	event_set( peer->rd, peer->fd, EV_READ | EV_PERSIST, peer_readable, peer );
+	event_base_set( av->base, peer->rd );
+	event_add( peer->rd, NULL );
+
+	// writable means the connect has completed, or failed
+	event_set( peer->wr, peer->fd, EV_WRITE, peer_writable, peer );
+	event_base_set( av->base, peer->wr );
+	event_add( peer->wr, NULL );
+	return 0;
+}
+
+static void peer_reconnect( int fd, short what, void* arg )
+{
+	_av_peer_t* peer = arg;
+	if( peer_connect( peer->av, peer ) != 0 )
+		peer_retry( peer );
+}
+
+// non-zero if a request to [peer] can be queued now
+static int peer_ready( const _av_peer_t* peer )
+{
+	// skip updates while waiting to reconnect, or if the peer is behind
+	return peer->fd >= 0 && peer->in_flight < AV_PEER_PIPELINE_MAX;
+}
+
+/* queue the headers of a POST of [len] bytes of [type] to [path] on
+	 [peer]'s link, for the caller to add the body and call
+	 peer_end(). Returns -1 if the peer is not ready. */
+static int peer_begin( _av_peer_t* peer, const char* path, const char* type, size_t len )
+{
+	if( ! peer_ready( peer ) )
+		return -1;
+
+	evbuffer_add_printf( peer->out,
+											 "POST %s HTTP/1.1\r\n"
+											 "Host: %s:%u\r\n"
+											 "Content-Type: %s\r\n"
+											 "Content-Length: %lu\r\n"
+											 "\r\n",
+											 path, peer->host, peer->port, type, (unsigned long)len );
+	peer->sent_at[ ( peer->sent_head + peer->in_flight ) % AV_PEER_PIPELINE_MAX ] = wall_usec();
+	peer->in_flight++;
+	peer->sent++;
+	return 0;
+}
+
+static void peer_end( _av_peer_t* peer )
+{
+	if( peer->connected )
+		event_add( peer->wr, NULL );
+}
+
+/* queue a POST of [body] to [path] on [peer]'s link, without waiting
+	 for the replies to earlier requests */
+static int peer_post( av_t* av, _av_peer_t* peer, const char* path, const char* body )
+{
+	const size_t len = strlen(body);
+	if( peer_begin( peer, path, "application/json", len ) != 0 )
+		return -1;
+
+	evbuffer_add( peer->out, body, len );
+	peer_end( peer );
+	return 0;
+}
+
+//- LOADING --------------------------------------------------------
+
+typedef struct
+{
+	const char* filename;
+	const char* me; // our logical name, once found
+	int errors;
+} load_ctx_t;
+
+static void load_peer( av_t* av, const char* section,
+											 char* key, char* value, void* arg )
+{
+	load_ctx_t* ctx = arg;
+	if( strcmp( section, "federation" ) != 0 )
+		return;
+
+	if( strcmp( key, av->hostportname ) == 0 )
+		{
+			ctx->me = value;
+			return; // don't link to ourselves
+		}
+
+	char* colon = strrchr( key, ':' );
+	if( colon == NULL )
+		{
+			printf( "[Avon] error: federation file %s: \"%s\" is not host:port\n",
+							ctx->filename, key );
+			ctx->errors++;
+			return;
+		}
+
+	// resolve now, as the event loop must not block on it at reconnect
+	char* host = strndup( key, colon - key );
+	struct addrinfo hints, *res = NULL;
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if( getaddrinfo( host, colon+1, &hints, &res ) != 0 || res == NULL )
+		{
+			printf( "[Avon] error: federation file %s: failed to resolve peer %s (%s)\n",
+							ctx->filename, value, host );
+			free( host );
+			ctx->errors++;
+			return;
+		}
+
+	_av_peer_t* peer = calloc( 1, sizeof(_av_peer_t) );
+	assert(peer);
+	peer->name = strdup( value );
+	peer->host = host;
+	peer->port = atoi( colon+1 );
+	peer->addr = res;
+	peer->fd = -1;
+	peer->av = av;
+	peer->backoff = AV_PEER_BACKOFF_MIN;
+	peer->retry = malloc( sizeof(struct event) );
+	assert( peer->retry );
+	evtimer_set( peer->retry, peer_reconnect, peer );
+	event_base_set( av->base, peer->retry );
+	HASH_ADD_KEYPTR( hh, av->peers, peer->name, strlen(peer->name), peer );
+}
+
+/* a member's section: note who owns and mirrors each model, and if
+	 it is ours, export the models listed */
+static void load_puppets( av_t* av, const char* section,
+													char* key, char* value, void* arg )
+{
+	load_ctx_t* ctx = arg;
+	const int mine = ctx->me && strcmp( section, ctx->me ) == 0;
+	_av_peer_t* member = NULL;
+	HASH_FIND_STR( av->peers, section, member );
+	if( ! mine && member == NULL )
+		return;
+
+	// value is a list of peer:prototype
+	char* save = NULL;
+	for( char* item = strtok_r( value, ";", &save ); item; item = strtok_r( NULL, ";", &save ) )
+		{
+			item = trim( item );
+			char* colon = strchr( item, ':' );
+			if( colon )
+				*colon = 0;
+			owners_add( av, key, section, item, colon ? colon+1 : "" );
+			if( ! mine )
+				continue;
+
+			_av_peer_t* peer = NULL;
+			HASH_FIND_STR( av->peers, item, peer );
+			if( peer == NULL )
+				{
+					printf( "[Avon] error: request to export %s/%s to unspecified server %s\n",
+									ctx->me, key, item );
+					ctx->errors++;
+					continue;
+				}
+
+			// a puppet record holds the name's length in 16 bits
+			if( strlen( key ) > UINT16_MAX )
+				{
+					printf( "[Avon] error: model name \"%.32s...\" is too long to mirror.\n", key );
+					ctx->errors++;
+					continue;
+				}
+
+			_av_puppet_t pup;
+			memset( &pup, 0, sizeof(pup) );
+			pup.model = intern( av, key );
+			pup.prototype = intern( av, colon ? colon+1 : "" );
+			pup.peer = peer;
+			utarray_push_back( av->puppets, &pup );
+		}
+}
+
+static void load_relay( av_t* av, const char* section,
+												char* key, char* value, void* arg )
+{
+	load_ctx_t* ctx = arg;
+	if( strcmp( section, "relay" ) != 0 )
+		return;
+
+	_av_peer_t* parent = NULL;
+	const int me = ctx->me && strcmp( key, ctx->me ) == 0;
+	if( ! me )
+		HASH_FIND_STR( av->peers, key, parent );
+	if( ! me && parent == NULL )
+		{
+			printf( "[Avon] error: federation file %s: relay %s is not in [federation]\n",
+							ctx->filename, key );
+			ctx->errors++;
+			return;
+		}
+
+	char* save = NULL;
+	for( char* item = strtok_r( value, ";", &save ); item; item = strtok_r( NULL, ";", &save ) )
+		{
+			item = trim( item );
+			if( ctx->me && strcmp( item, ctx->me ) == 0 )
+				continue; // our own parent is no concern of ours
+
+			_av_peer_t* child = NULL;
+			HASH_FIND_STR( av->peers, item, child );
+			if( child == NULL || child == parent || child->parent || child->relay_child )
+				{
+					printf( "[Avon] error: federation file %s: bad relay child %s of %s\n",
+									ctx->filename, item, key );
+					ctx->errors++;
+					continue;
+				}
+			child->parent = parent;
+			child->relay_child = me;
+		}
+}
+
+/* find the peer each one's updates go through: itself if we send to
+	 it directly, or else the top of its branch of the relay tree below
+	 us. Returns -1 if the tree has a cycle. */
+static int relay_routes( av_t* av )
+{
+	const uint32_t count = HASH_COUNT( av->peers );
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		{
+			_av_peer_t* cur = peer;
+			peer->hops = 1;
+			while( ! cur->relay_child && cur->parent )
+				{
+					cur = cur->parent;
+					if( ++peer->hops > count )
+						{
+							printf( "[Avon] error: the relay tree has a cycle through %s\n", peer->name );
+							return -1;
+						}
+				}
+			peer->via = cur;
+		}
+	return 0;
+}
+
+int av_load_federation( av_t* av, const char* filename )
+{
+	assert(av);
+	assert(filename);
+
+	if( av->base == NULL )
+		{
+			puts( "[Avon] error: av_load_federation() must be called after av_startup()" );
+			return -1;
+		}
+
+	char* text = read_file( filename );
+	if( text == NULL )
+		{
+			printf( "[Avon] error: can't read the federation file %s\n", filename );
+			return -1;
+		}
+
+	// the peers first, so that puppets can refer to them
+	load_ctx_t ctx = { filename, NULL, 0 };
+	char* copy = strdup( text );
+	ini_each( av, copy, load_peer, &ctx );
+
+	if( ctx.me == NULL )
+		printf( "[Avon] warning: %s is not listed in the [federation] section of %s\n",
+						av->hostportname, filename );
+	else
+		{
+			free( av->fed_name );
+			av->fed_name = strdup( ctx.me );
+		}
+
+	if( av->puppets == NULL )
+		utarray_new( av->puppets, &_av_puppet_icd );
+	char* relays = strdup( text );
+	ini_each( av, relays, load_relay, &ctx );
+	free( relays );
+	if( relay_routes( av ) != 0 )
+		ctx.errors++;
+
+	ini_each( av, text, load_puppets, &ctx );
+
+	free( copy ); // after the relay and puppet passes, as ctx.me points into it
+	free( text );
+
+	/* start connecting to every peer at once, without waiting for any
+		 of them. Those not up yet are retried with backoff, so the
+		 federation is up soon after its slowest member. */
+	_av_peer_t* peer;
+	for( peer = av->peers; peer; peer = peer->hh.next )
+		if( peer->fd < 0 && peer_connect( av, peer ) != 0 )
+			peer_retry( peer );
+
+	return ctx.errors ? -1 : 0;
+}
+
+int av_federation_ready( av_t* av )
+{
+	assert(av);
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		if( ! peer->connected )
+			return 0;
+	return 1;
+}
+
+//- MIRRORING ------------------------------------------------------
+
+int av_set_dead_reckoning( av_t* av, double position, double angle )
+{
+	assert(av);
+	if( position < 0 || angle < 0 )
+		{
+			puts( "[Avon] error: dead reckoning thresholds must not be negative" );
+			return -1;
+		}
+	av->dr_position = position;
+	av->dr_angle = angle;
+	return 0;
+}
+
+// [pva] advanced by [dt] seconds at constant acceleration
+static void extrapolate( const av_pva_t* pva, double dt, av_pva_t* out )
+{
+	for( int i=0; i<6; i++ )
+		{
+			out->p[i] = pva->p[i] + dt * ( pva->v[i] + 0.5 * dt * pva->a[i] );
+			out->v[i] = pva->v[i] + dt * pva->a[i];
+			out->a[i] = pva->a[i];
+		}
+}
+
+static double seconds_since( av_t* av, uint64_t then )
+{
+	const uint64_t now = (*av->clock_get)( av->clock_get_user );
+	return now > then ? (now - then) / 1e6 : 0.0;
+}
+
+/* non-zero if a peer extrapolating [pup]'s last update would now be
+	 further from [pva] than the dead reckoning thresholds allow */
+static int dr_exceeded( av_t* av, const _av_puppet_t* pup, const av_pva_t* pva )
+{
+	if( ! pup->sent_valid )
+		return 1;
+
+	av_pva_t guess;
+	extrapolate( &pup->sent, seconds_since( av, pup->sent_time ), &guess );
+
+	const double dx = pva->p[0] - guess.p[0];
+	const double dy = pva->p[1] - guess.p[1];
+	const double dz = pva->p[2] - guess.p[2];
+	if( av->dr_position > 0 && 
+			sqrt( dx*dx + dy*dy + dz*dz ) > av->dr_position )
+		return 1;
+
+	if( av->dr_angle > 0 )
+		for( int i=3; i<6; i++ )
+			if( fabs( remainder( pva->p[i] - guess.p[i], 2*M_PI ) ) > av->dr_angle )
+				return 1;
+
+	return 0;
+}
+
+/* non-zero if [node] is in a region [peer] can sense, or if the peer
+	 has not said what it can sense */
+static int peer_interested( const _av_peer_t* peer, const _av_node_t* node )
+{
+	if( peer->interest == NULL )
+		return 1;
+
+	for( _av_circle_t* c = (_av_circle_t*)utarray_front( peer->interest );
+			 c;
+			 c = (_av_circle_t*)utarray_next( peer->interest, c ) )
+		{
+			const double dx = node->world[0] - c->x;
+			const double dy = node->world[1] - c->y;
+			const double r = c->r + node->radius;
+			if( dx*dx + dy*dy <= r*r )
+				return 1;
+		}
+	return 0;
+}
+
+/* add a record for puppet [name] to the frame being built for
+	 [peer]. Records for peers below it in the relay tree go in the
+	 same frame, which it forwards. */
+static void frame_add( _av_peer_t* peer, const char* name, const av_pva_t* pva, uint8_t flags )
+{
+	if( peer->frame == NULL )
+		peer->frame = evbuffer_new();
+	assert( peer->frame );
+
+	assert( strlen( name ) <= UINT16_MAX ); // checked by federation_exports()
+	const uint16_t len = strlen( name );
+	evbuffer_add( peer->frame, pva->p, sizeof(pva->p) );
+	evbuffer_add( peer->frame, pva->v, sizeof(pva->v) );
+	evbuffer_add( peer->frame, pva->a, sizeof(pva->a) );
+	evbuffer_add( peer->frame, &len, sizeof(len) );
+	evbuffer_add( peer->frame, &flags, sizeof(flags) );
+	evbuffer_add( peer->frame, name, len );
+	peer->frame_count++;
+}
+
+// send each peer its frame of puppet records, as one request
+static void frame_flush( av_t* av )
+{
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		{
+			if( peer->frame_count == 0 )
+				continue;
+
+			const uint32_t header[2] = { AV_PUPPET_FRAME_MAGIC, peer->frame_count };
+			const size_t len = sizeof(header) + EVBUFFER_LENGTH( peer->frame );
+
+			const char* path = peer->frame_relay ? "/sim/puppets?relay=1" : "/sim/puppets";
+			if( peer_begin( peer, path, "application/octet-stream", len ) == 0 )
+				{
+					evbuffer_add( peer->out, header, sizeof(header) );
+					evbuffer_add_buffer( peer->out, peer->frame );
+					peer_end( peer );
+				}
+			else
+				{
+					// the link went down since we checked: drop the frame, and
+					// forget what its puppets were sent so they are sent again
+					printf( "[Avon] error: dropped a frame of %u updates to peer \"%s\".\n",
+									peer->frame_count, peer->name );
+					evbuffer_drain( peer->frame, EVBUFFER_LENGTH( peer->frame ) );
+					peer_forget( peer );
+				}
+			peer->frame_count = 0;
+			peer->frame_relay = 0;
+			peer->frame_last = NULL;
+		}
+}
+
+// POST [body] to [path] on every peer
+void federation_broadcast( av_t* av, const char* path, const char* body )
+{
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		peer_post( av, peer, path, body );
+}
+
+/* after [own]'s model has moved, export it into its mirrors if it is
+	 now ours, or stop if it is not */
+void federation_exports( av_t* av, const _av_owner_t* own )
+{
+	if( av->puppets == NULL )
+		utarray_new( av->puppets, &_av_puppet_icd );
+
+	for( unsigned i=0; i<utarray_len( av->puppets ); )
+		{
+			const _av_puppet_t* pup = (_av_puppet_t*)utarray_eltptr( av->puppets, i );
+			if( pup->model == own->model )
+				utarray_erase( av->puppets, i, 1 );
+			else
+				i++;
+		}
+
+	if( ! owned_here( av, own ) )
+		return;
+
+	// a puppet record holds the name's length in 16 bits
+	if( strlen( own->model ) > UINT16_MAX )
+		{
+			printf( "[Avon] error: model name \"%.32s...\" is too long to mirror.\n",
+							own->model );
+			return;
+		}
+
+	for( unsigned i=0; i<utarray_len( own->mirrors ); i++ )
+		{
+			const char* name = *(const char**)utarray_eltptr( own->mirrors, i );
+			_av_peer_t* peer = NULL;
+			HASH_FIND_STR( av->peers, name, peer );
+			if( peer == NULL )
+				continue;
+
+			_av_puppet_t pup;
+			memset( &pup, 0, sizeof(pup) );
+			pup.model = own->model;
+			pup.prototype = own->prototype;
+			pup.peer = peer;
+			utarray_push_back( av->puppets, &pup );
+		}
+}
+
+/* forward a relayed frame of [len] bytes at [data] to the peers we
+	 relay for, who each apply the records for their puppets and
+	 forward it again */
+void federation_relay( av_t* av, const void* data, size_t len )
+{
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		if( peer->relay_child && 
+				peer_begin( peer, "/sim/puppets?relay=1", "application/octet-stream", len ) == 0 )
+			{
+				evbuffer_add( peer->out, data, len );
+				peer_end( peer );
+			}
+}
+
+/* send the pva of exported models to their puppets: every model that
+	 moved in this tick or whose puppet has not been sent it, or with
+	 dead reckoning, those the peer's extrapolation no longer matches.
+	 The updates for each peer go in one binary frame, rather than a
+	 request per puppet. */
+void federation_push( av_t* av )
+{
+	if( av->puppets == NULL )
+		return;
+
+	const int dr = av->dr_position > 0 || av->dr_angle > 0;
+	const uint64_t now = (*av->clock_get)( av->clock_get_user );
+
+	for( _av_puppet_t* pup = (_av_puppet_t*)utarray_front( av->puppets );
+			 pup;
+			 pup = (_av_puppet_t*)utarray_next( av->puppets, pup ) )
+		{
+			_av_node_t* node = NULL;
+			HASH_FIND_STR( av->tree, pup->model, node );
+			if( node == NULL || ( ! dr && pup->sent_valid && ! node->world_changed ) )
+				continue;
+
+			// the frame is sent this tick only if the peer it goes via can take it
+			_av_peer_t* via = pup->peer->via;
+			if( ! peer_ready( via ) )
+				continue;
+
+			// skip models the peer has told us it cannot sense
+			if( ! peer_interested( pup->peer, node ) )
+				continue;
+
+			av_pva_t pva;
+			(*av->pva_get)( node->handle, &pva );
+			if( dr && ! dr_exceeded( av, pup, &pva ) )
+				continue;
+
+			// a model mirrored into several peers down one relay branch
+			// needs just one record, as puppets are listed model by model
+			if( via->frame_last != pup->model )
+				{
+					frame_add( via, pup->model, &pva, dr ? AV_PUPPET_DR : 0 );
+					via->frame_last = pup->model;
+				}
+			if( via != pup->peer )
+				via->frame_relay = 1;
+
+			pup->sent = pva;
+			pup->sent_time = now;
+			pup->sent_valid = 1;
+		}
+
+	frame_flush( av );
+}
+
+/* move each puppet along its last dead reckoning update, as its owner
+	 does not send one while the extrapolation is good enough */
+void federation_dead_reckon( av_t* av )
+{
+	for( _av_dr_t* d = av->dr; d; d = d->hh.next )
+		{
+			av_pva_t pva;
+			extrapolate( &d->pva, seconds_since( av, d->time ), &pva );
+			pva.time = (*av->clock_get)( av->clock_get_user );
+			(*av->pva_set)( _av_node_at( av, d->node )->handle, &pva );
+		}
+}
+
+// keep [pva], from a peer dead reckoning [node], to extrapolate
+void federation_dr_set( av_t* av, _av_node_t* node, const av_pva_t* pva )
+{
+	_av_dr_t* d = NULL;
+	if( node->dead_reckoned )
+		HASH_FIND( hh, av->dr, &node->index, sizeof(node->index), d );
+	if( d == NULL )
+		{
+			d = malloc( sizeof(_av_dr_t) );
+			assert(d);
+			d->node = node->index;
+			HASH_ADD( hh, av->dr, node, sizeof(d->node), d );
+			node->dead_reckoned = 1;
+		}
+	d->pva = *pva;
+	d->time = (*av->clock_get)( av->clock_get_user );
+}
+
+// stop extrapolating [node]
+void federation_dr_clear( av_t* av, _av_node_t* node )
+{
+	if( ! node->dead_reckoned )
+		return;
+
+	_av_dr_t* d = NULL;
+	HASH_FIND( hh, av->dr, &node->index, sizeof(node->index), d );
+	assert(d);
+	HASH_DEL( av->dr, d );
+	free( d );
+	node->dead_reckoned = 0;
+}
+
+//- INTEREST MANAGEMENT --------------------------------------------
+
+/* note how far [node]'s sensors can see, from its ranger or fiducial
+	 cfg, so that our peers need only send us models within that range */
+void federation_sense_range( av_t* av, _av_node_t* node )
+{
+	_av_sensor_t* sensor = sensor_of( av, node );
+	if( sensor == NULL )
+		return;
+	sensor->sense_range = 0;
+
+	const av_interface_t interface = node->interface;
+	if( av->cfg_get[interface] == NULL )
+		return;
+
+	av_msg_t cfg;
+	bzero( &cfg, sizeof(cfg) );
+	(*av->cfg_get[interface])( node->handle, &cfg );
+	if( cfg.data == NULL )
+		return;
+
+	if( interface == AV_INTERFACE_RANGER )
+		{
+			const av_ranger_cfg_t* rc = cfg.data;
+			for( uint32_t i=0; i<rc->transducer_count && i<AV_RANGER_TRANSDUCERS_MAX; i++ )
+				{
+					// the transducer may be mounted off the model's origin
+					const double r = rc->transducers[i].fov[2].max + 
+						hypot( rc->transducers[i].geom.pose[0], rc->transducers[i].geom.pose[1] );
+					if( r > sensor->sense_range )
+						sensor->sense_range = r;
+				}
+		}
+	else if( interface == AV_INTERFACE_FIDUCIAL )
+		sensor->sense_range = ((const av_fiducial_cfg_t*)cfg.data)->fov[2].max;
+}
+
+// the regions our sensing models can see now
+static void interest_regions( av_t* av, UT_array* regions )
+{
+	for( _av_sensor_t* s = av->sensors; s; s = s->hh.next )
+		if( s->sense_range > 0 )
+			{
+				const _av_node_t* node = _av_node_at( av, s->node );
+				_av_circle_t c = { node->world[0], node->world[1], 
+													 s->sense_range + node->radius + AV_INTEREST_MARGIN };
+				utarray_push_back( regions, &c );
+			}
+}
+
+// non-zero if [now] differs from [sent] by more than the margin allows
+static int interest_moved( const UT_array* sent, const UT_array* now )
+{
+	// with no sensors we never subscribed, so there is nothing to tell
+	if( sent == NULL )
+		return utarray_len(now) > 0;
+	if( utarray_len(sent) != utarray_len(now) )
+		return 1;
+
+	const double slack = 0.5 * AV_INTEREST_MARGIN;
+	for( unsigned i=0; i<utarray_len(now); i++ )
+		{
+			const _av_circle_t* a = (_av_circle_t*)utarray_eltptr( (UT_array*)sent, i );
+			const _av_circle_t* b = (_av_circle_t*)utarray_eltptr( (UT_array*)now, i );
+			if( hypot( a->x - b->x, a->y - b->y ) > slack || fabs( a->r - b->r ) > slack )
+				return 1;
+		}
+	return 0;
+}
+
+/* tell our peers which regions we can sense, if that has changed
+	 enough since we last did */
+void federation_interest( av_t* av )
+{
+	if( av->peers == NULL || av->fed_name == NULL )
+		return;
+
+	UT_array* regions;
+	utarray_new( regions, &_av_circle_icd );
+	interest_regions( av, regions );
+
+	if( ! interest_moved( av->interest_sent, regions ) )
+		{
+			utarray_free( regions );
+			return;
+		}
+
+	char* xdr = xdr_format_interest( av->fed_name, regions );
+	int ok = 1;
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		if( peer_post( av, peer, "/sim/interest", xdr ) != 0 )
+			ok = 0;
+	free( xdr );
+
+	// if a peer missed it, try again next tick
+	if( ok )
+		{
+			if( av->interest_sent )
+				utarray_free( av->interest_sent );
+			av->interest_sent = regions;
+		}
+	else
+		utarray_free( regions );
+}
+
+/* record that [peer] can sense only [regions], which we take ownership
+	 of. Returns -1 if there is no such peer. */
+int federation_set_interest( av_t* av, const char* name, UT_array* regions )
+{
+	_av_peer_t* peer = NULL;
+	HASH_FIND_STR( av->peers, name, peer );
+	if( peer == NULL )
+		{
+			utarray_free( regions );
+			return -1;
+		}
+
+	if( peer->interest )
+		utarray_free( peer->interest );
+
+	// a peer with no sensors left has no use for filtering, e.g. it may
+	// only be displaying the world, so it gets everything again
+	if( utarray_len( regions ) == 0 )
+		{
+			utarray_free( regions );
+			regions = NULL;
+		}
+	peer->interest = regions;
+
+	// models now in view may stand still, so send them all again
+	if( av->puppets )
+		for( _av_puppet_t* pup = (_av_puppet_t*)utarray_front( av->puppets );
+				 pup;
+				 pup = (_av_puppet_t*)utarray_next( av->puppets, pup ) )
+			if( pup->peer == peer )
+				pup->sent_valid = 0;
+	return 0;
+}
+
+//- TIME SYNCHRONIZATION -------------------------------------------
+
+/* Conservative synchronization: rather than every member
+	 acknowledging each step, each advertises a grant, its clock plus
+	 its lookahead window, and each may run up to the smallest grant of
+	 its peers without waiting for them. */
+
+int av_set_lookahead( av_t* av, uint64_t lookahead )
+{
+	assert(av);
+	if( av->clock_get == NULL )
+		{
+			puts( "[Avon] error: clock callbacks must be installed before av_set_lookahead()" );
+			return -1;
+		}
+	av->lookahead = lookahead;
+	return 0;
+}
+
+static uint64_t safe_time( av_t* av )
+{
+	// a client running us for a while or by steps bounds us too
+	uint64_t t = clock_bound( av );
+	if( av->lookahead == 0 )
+		return t;
+
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		if( peer->grant < t )
+			t = peer->grant;
+	return t;
+}
+
+uint64_t av_safe_time( av_t* av )
+{
+	assert(av);
+
+	// a simulator waiting here may not be calling av_tick()
+	federation_sync( av );
+	return safe_time( av );
+}
+
+/* send our grant to each peer that has used up half of the last one
+	 we sent it, so that one message covers many ticks */
+void federation_sync( av_t* av )
+{
+	if( av->lookahead == 0 || av->peers == NULL || av->fed_name == NULL )
+		return;
+
+	const uint64_t now = (*av->clock_get)( av->clock_get_user );
+	const uint64_t grant = now + av->lookahead;
+
+	char* xdr = NULL;
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		{
+			if( peer->grant_sent && grant < peer->grant_sent + av->lookahead / 2 )
+				continue;
+
+			if( xdr == NULL )
+				xdr = xdr_format_sync( av->fed_name, now, av->lookahead );
+
+			// if it can't be sent now, try again next time
+			if( peer_post( av, peer, "/sim/sync", xdr ) == 0 )
+				peer->grant_sent = grant;
+		}
+	free( xdr );
+}
+
+/* record the grant of [peer], who is at [time] with a [lookahead]
+	 window. Returns -1 if there is no such peer. */
+int federation_set_grant( av_t* av, const char* name, uint64_t time, uint64_t lookahead )
+{
+	_av_peer_t* peer = NULL;
+	HASH_FIND_STR( av->peers, name, peer );
+	if( peer == NULL )
+		return -1;
+
+	// grants only grow, even if the peer's link was re-established
+	const uint64_t grant = lookahead < UINT64_MAX - time ? time + lookahead : UINT64_MAX;
+	if( grant > peer->grant )
+		peer->grant = grant;
+
+	const uint64_t limit = safe_time( av );
+	if( av->lookahead && limit > av->limit_told )
+		{
+			av->limit_told = limit;
+			if( av->clock_limit )
+				(*av->clock_limit)( av->clock_limit_user, limit );
+		}
+	return 0;
+}
+
+void federation_fini( av_t* av )
+{
+	_av_peer_t *peer, *tmp;
+	HASH_ITER( hh, av->peers, peer, tmp )
+		{
+			HASH_DEL( av->peers, peer );
+			peer_close( peer );
+			event_del( peer->retry );
+			free( peer->retry );
+			if( peer->frame )
+				evbuffer_free( peer->frame );
+			if( peer->interest )
+				utarray_free( peer->interest );
+			freeaddrinfo( peer->addr );
+			free( peer->name );
+			free( peer->host );
+			free( peer );
+		}
+
+	if( av->puppets )
+		utarray_free( av->puppets );
+	_av_dr_t *d, *dtmp;
+	HASH_ITER( hh, av->dr, d, dtmp )
+		{
+			HASH_DEL( av->dr, d );
+			free( d );
+		}
+	if( av->interest_sent )
+		utarray_free( av->interest_sent );
+	free( av->fed_name );
+}
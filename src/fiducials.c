@@ -0,0 +1,191 @@
+/*
+  File: fiducials.c
+  Description: inverted index from fiducial id to the models that
+  currently detect it
+  Version: $Id:$
+  License: LGPL v3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memcpy()
+#include <assert.h>
+
+#include "avon.h"
+#include "avon_internal.h"
+
+static const UT_icd _av_sighting_icd = { sizeof(_av_sighting_t), NULL, NULL, NULL };
+static const UT_icd _av_id_icd = { sizeof(uint64_t), NULL, NULL, NULL };
+
+// remove [node]'s sighting of [id], freeing the entry if it was the last
+static void sighting_remove( struct av* av, const _av_node_t* node, uint64_t id )
+{
+	_av_seen_t* seen = NULL;
+	HASH_FIND( hh, av->seen, &id, sizeof(id), seen );
+	if( seen == NULL )
+		return;
+
+	const uint32_t n = utarray_len( seen->sightings );
+	for( uint32_t i=0; i<n; i++ )
+		{
+			_av_sighting_t* s = (_av_sighting_t*)utarray_eltptr( seen->sightings, i );
+			if( s->node != node->index )
+				continue;
+
+			// swap-remove, as order is not significant
+			_av_sighting_t* last = (_av_sighting_t*)utarray_back( seen->sightings );
+			if( s != last )
+				*s = *last;
+			utarray_pop_back( seen->sightings );
+			break;
+		}
+
+	if( utarray_len( seen->sightings ) == 0 )
+		{
+			HASH_DEL( av->seen, seen );
+			utarray_free( seen->sightings );
+			free( seen );
+		}
+}
+
+void fiducials_remove( struct av* av, _av_node_t* node )
+{
+	_av_sensor_t* sensor = sensor_of( av, node );
+	if( sensor == NULL || sensor->seen_ids == NULL )
+		return;
+
+	for( uint64_t* id = (uint64_t*)utarray_front( sensor->seen_ids );
+			 id;
+			 id = (uint64_t*)utarray_next( sensor->seen_ids, id ) )
+		sighting_remove( av, node, *id );
+
+	utarray_clear( sensor->seen_ids );
+}
+
+/* replace [node]'s sightings with the detections in [data]. Only the
+	 ids the node saw last time and sees now are touched. */
+void fiducials_update( struct av* av, _av_node_t* node, const av_msg_t* data )
+{
+	_av_sensor_t* sensor = sensor_of( av, node );
+	assert( sensor );
+	if( sensor->seen_ids == NULL )
+		utarray_new( sensor->seen_ids, &_av_id_icd );
+
+	fiducials_remove( av, node );
+
+	av_fiducial_view_t fid;
+	fiducial_view( data, &fid );
+
+	_av_fiducial_rec_t recs[AV_ELEMENT_BLOCK];
+	for( uint32_t i=0, n; (n = fiducial_block( &fid, i, recs )) > 0; )
+		{
+			for( uint32_t b=0; b<n; b++, i++ )
+				{
+					const _av_fiducial_rec_t* r = &recs[b];
+
+					_av_seen_t* seen = NULL;
+					HASH_FIND( hh, av->seen, &r->id, sizeof(r->id), seen );
+					if( seen == NULL )
+						{
+							seen = calloc( 1, sizeof(_av_seen_t) );
+							assert(seen);
+							seen->id = r->id;
+							utarray_new( seen->sightings, &_av_sighting_icd );
+							HASH_ADD( hh, av->seen, id, sizeof(seen->id), seen );
+						}
+					else
+						{
+							// a model reporting the same marker twice keeps the last
+							_av_sighting_t* s = (_av_sighting_t*)utarray_back( seen->sightings );
+							if( s && s->node == node->index )
+								{
+									memcpy( s->pose, r->pose, sizeof(s->pose) );
+									continue;
+								}
+						}
+
+					_av_sighting_t s;
+					s.node = node->index;
+					memcpy( s.pose, r->pose, sizeof(s.pose) );
+					utarray_push_back( seen->sightings, &s );
+					utarray_push_back( sensor->seen_ids, &r->id );
+				}
+		}
+}
+
+// add fiducial model [node] to the models whose detections are indexed
+void fiducials_register( struct av* av, _av_node_t* node )
+{
+	_av_sensor_t* sensor = sensor_of( av, node );
+	assert( sensor );
+
+	if( av->fiducials == NULL )
+		utarray_new( av->fiducials, &_av_index_icd );
+	sensor->fiducial_slot = utarray_len( av->fiducials );
+	utarray_push_back( av->fiducials, &node->index );
+	av->seen_dirty = 1;
+}
+
+// drop [node]'s sightings and stop indexing it, in constant time
+void fiducials_unregister( struct av* av, _av_node_t* node )
+{
+	_av_sensor_t* sensor = sensor_of( av, node );
+	assert( sensor );
+
+	fiducials_remove( av, node );
+
+	// move the last fiducial model into our slot
+	const uint32_t last = *(uint32_t*)utarray_back( av->fiducials );
+	*(uint32_t*)utarray_eltptr( av->fiducials, sensor->fiducial_slot ) = last;
+	sensor_of( av, _av_node_at( av, last ) )->fiducial_slot = sensor->fiducial_slot;
+	utarray_pop_back( av->fiducials );
+}
+
+/* bring the index up to date with each fiducial model's detections,
+	 if there has been an av_tick() since it was last built */
+static void fiducials_refresh( struct av* av )
+{
+	if( ! av->seen_dirty || av->fiducials == NULL || 
+			av->data_get[AV_INTERFACE_FIDUCIAL] == NULL )
+		return;
+
+	for( uint32_t* i = (uint32_t*)utarray_front( av->fiducials );
+			 i;
+			 i = (uint32_t*)utarray_next( av->fiducials, i ) )
+		{
+			_av_node_t* node = _av_node_at( av, *i );
+
+			av_msg_t data;
+			memset( &data, 0, sizeof(data) );
+			(*av->data_get[AV_INTERFACE_FIDUCIAL])( node->handle, &data );
+			if( data.data )
+				fiducials_update( av, node, &data );
+			else
+				fiducials_remove( av, node );
+		}
+
+	av->seen_dirty = 0;
+}
+
+_av_seen_t* fiducials_lookup( struct av* av, uint64_t id )
+{
+	fiducials_refresh( av );
+
+	_av_seen_t* seen = NULL;
+	HASH_FIND( hh, av->seen, &id, sizeof(id), seen );
+	return seen;
+}
+
+void fiducials_fini( struct av* av )
+{
+	_av_seen_t *seen, *tmp;
+	HASH_ITER( hh, av->seen, seen, tmp )
+		{
+			HASH_DEL( av->seen, seen );
+			utarray_free( seen->sightings );
+			free( seen );
+		}
+
+	if( av->fiducials )
+		utarray_free( av->fiducials );
+}
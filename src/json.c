@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h> // for malloc(), strtoull()
 #include <string.h> // for memset()
 #include <assert.h>
+#include <math.h> // for sin(), cos()
 
 // libjson-c [tested with v0.9]
 #include <json.h>
@@ -8,10 +10,6 @@
 #include "avon.h"
 #include "avon_internal.h"
 
-// hash table handle
-extern _av_node_t* _tree; 
-extern _av_node_t  _root;
-
 // utilties and wrappers ---------------------------------------
 
 void uts_print_time( UT_string* s, uint64_t t )
@@ -39,6 +37,23 @@ void print_double_array( UT_string* s, const double v[], size_t len )
 	utstring_printf( s, "]" );
 }
 
+void print_float_array( UT_string* s, const float v[], size_t len )
+{
+	assert(s);
+	assert(v);
+	assert(len>0);
+	
+	utstring_printf( s, "[" );
+	for( int i=0; i<len; i++ )
+		{
+			if( i > 0 )				
+				utstring_printf(s, "," );		
+			
+			utstring_printf(s, "%.3f", (double)v[i] );
+		}
+	utstring_printf( s, "]" );
+}
+
 void print_named_double_array( UT_string* s, const char* key, const double v[], size_t len, const char* suffix )
 {
   utstring_printf( s, "\"%s\" : ", key );
@@ -47,6 +62,14 @@ void print_named_double_array( UT_string* s, const char* key, const double v[],
 	 utstring_printf( s, "%s", suffix );	 
 }
 
+void print_named_float_array( UT_string* s, const char* key, const float v[], size_t len, const char* suffix )
+{
+  utstring_printf( s, "\"%s\" : ", key );
+  print_float_array( s, v, len );
+  if( suffix )
+	 utstring_printf( s, "%s", suffix );	 
+}
+
 /* wrapper to hide macro thus cleaner syntax on use */
 UT_string* uts_new(void)
 {
@@ -67,26 +90,52 @@ char* uts_dup_free( UT_string* s )
 // the data exporting functions ------------------------------------------------
 
 
-char* xdr_tree( const char* name )
-{
-  UT_string* s;
-  utstring_new(s);
-	
-	_av_node_t* node = NULL;
-	if( name )
-		HASH_FIND_STR( _tree, name, node );
-	else
-		node = &_root;
-	assert( node );
+char* xdr_format_geom( const av_geom_t* g );
 
-	utstring_printf(s, "{ \"name\" : \"%s\", \"prototype\" : \"%s\", \"interface\": %d, \"children\" : [", 
+/* format [node] and its descendants down to [depth] more levels
+	 (unlimited if negative), including the properties selected by
+	 [fields] for each model */
+static void xdr_tree_node( UT_string* s, av_t* av, const _av_node_t* node, 
+													 int depth, int fields )
+{
+	utstring_printf(s, "{ \"name\" : \"%s\", \"prototype\" : \"%s\", \"interface\": %d, ", 
 									node->id, 
 									node->prototype,
 									node->interface );
 	
+	// the root is the sim itself, with no model handle
+	if( node != av->root )
+		{
+			if( fields & AV_FIELD_PVA )
+				{
+					av_pva_t pva;
+					(*av->pva_get)( node->handle, &pva );
+					print_named_double_array( s, "pose", pva.p, 6, ", " );
+				}
+
+			if( fields & AV_FIELD_GEOM )
+				{
+					av_geom_t geom;
+					(*av->geom_get)( node->handle, &geom );
+					char* g = xdr_format_geom( &geom );
+					utstring_printf(s, "\"geom\" : %s, ", g );
+					free(g);
+				}
+		}
+
+	utstring_printf(s, "\"children\" : [" );
+	
+	// at the depth limit, report only how many children there are
+	if( depth == 0 )
+		{
+			utstring_printf(s, "], \"child_count\" : %u }", 
+											node->children ? utarray_len(node->children) : 0 );
+			return;
+		}
+	
 	int first = 1;
-  char** p = NULL;
-  while ( (p=(char**)utarray_next(node->children,p))) 
+  uint32_t* c = NULL;
+  while ( node->children && (c=(uint32_t*)utarray_next(node->children,c))) 
 		{
 			// print commas before all but the first array entry
 			if( first )
@@ -94,18 +143,265 @@ char* xdr_tree( const char* name )
 			else
 				utstring_printf(s, "," );
 					
-			char* json = xdr_tree( *p );
-			utstring_printf(s, " %s", json );
-			free(json);
+			utstring_printf(s, " " );
+			xdr_tree_node( s, av, _av_node_at(av,*c), depth-1, fields );
 		}	
 	
 	utstring_printf(s, "] }" );
+}
+
+/* the subtree rooted at [node], or the whole tree if NULL. See
+	 xdr_tree_node() for [depth] and [fields]. */
+char* xdr_tree( av_t* av, const _av_node_t* node, int depth, int fields )
+{
+	assert(av);
+
+	if( node == NULL )
+		node = av->root;
+
+  UT_string* s;
+  utstring_new(s);
+	
+	// format the whole subtree into a single string
+	xdr_tree_node( s, av, node, depth, fields );
 	
   //printf("utstring: %s\n", utstring_body(s));
 	
 	return uts_dup_free(s); // caller must free
 }
 
+/* a list of models and their poses, e.g. the result of a spatial
+	 query, in the world frame if [world] is non-zero */
+char* xdr_format_models( av_t* av, const UT_array* indices, int world )
+{
+	assert(av);
+	assert(indices);
+
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"frame\" : \"%s\", \"model_count\" : %u, \"models\" : [", 
+									world ? "world" : "local", utarray_len(indices) );
+	
+	for( unsigned i=0; i<utarray_len(indices); i++ )
+		{
+			const _av_node_t* node = 
+				_av_node_at( av, *(uint32_t*)utarray_eltptr( (UT_array*)indices, i ) );
+			
+			if( i > 0 )				
+				utstring_printf(s, "," );		
+			
+			utstring_printf(s, "\n { \"name\" : \"%s\", ", node->id );
+			print_named_double_array( s, "pose", world ? node->world : node->pose, 6, " }" );
+		}
+	
+	utstring_printf(s, " ] }\n" );
+	return uts_dup_free(s);
+}
+
+/* the federation links, and the relay tree: its depth, the one-way
+	 latency of a hop estimated from our links' round trips, and if
+	 [budget] usec is not 0, the deepest tree whose latency is within it */
+char* xdr_format_peers( av_t* av, uint64_t budget )
+{
+	assert(av);
+
+	uint32_t depth = 0, measured = 0;
+	uint64_t rtt_sum = 0;
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		{
+			if( peer->hops > depth )
+				depth = peer->hops;
+			if( peer->rtt )
+				{
+					rtt_sum += peer->rtt;
+					measured++;
+				}
+		}
+	const uint64_t hop = measured ? rtt_sum / measured / 2 : 0;
+
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"peer_count\" : %u, \"relay\" : { \"depth\" : %u, \"hop_usec\" : %llu",
+									HASH_COUNT( av->peers ), depth, (unsigned long long)hop );
+	if( budget && hop )
+		utstring_printf(s, ", \"budget_usec\" : %llu, \"max_depth\" : %llu",
+										(unsigned long long)budget, (unsigned long long)( budget / hop ) );
+	utstring_printf(s, " }, \"peers\" : [" );
+	
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		utstring_printf(s, "%s\n { \"name\" : \"%s\", \"host\" : \"%s:%u\", "
+										"\"connected\" : %s, \"in_flight\" : %u, "
+										"\"sent\" : %llu, \"acked\" : %llu, \"failed\" : %llu, "
+										"\"grant\" : %llu, \"via\" : \"%s\", \"hops\" : %u, "
+										"\"rtt_usec\" : %llu }",
+										peer == av->peers ? "" : ",",
+										peer->name, peer->host, peer->port,
+										peer->connected ? "true" : "false", peer->in_flight,
+										(unsigned long long)peer->sent,
+										(unsigned long long)peer->acked,
+										(unsigned long long)peer->failed,
+										(unsigned long long)peer->grant,
+										peer->via ? peer->via->name : peer->name, peer->hops,
+										(unsigned long long)peer->rtt );
+	
+	utstring_printf(s, " ] }\n" );
+	return uts_dup_free(s);
+}
+
+/* the regions of interest of the federation member [name] */
+char* xdr_format_interest( const char* name, const UT_array* regions )
+{
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"peer\" : \"%s\", \"regions\" : [", name );
+	
+	for( unsigned i=0; i<utarray_len(regions); i++ )
+		{
+			const _av_circle_t* c = (_av_circle_t*)utarray_eltptr( (UT_array*)regions, i );
+			utstring_printf(s, "%s[%.3f,%.3f,%.3f]", i ? "," : "", c->x, c->y, c->r );
+		}
+	
+	utstring_printf(s, "] }\n" );
+	return uts_dup_free(s);
+}
+
+/* the clock and lookahead window of the federation member [name] */
+char* xdr_format_sync( const char* name, uint64_t time, uint64_t lookahead )
+{
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"peer\" : \"%s\", \"time\" : %llu, \"lookahead\" : %llu }\n",
+									name, (unsigned long long)time, (unsigned long long)lookahead );
+	return uts_dup_free(s);
+}
+
+/* a pva set held for sim time [at], and how many sets are waiting */
+char* xdr_format_scheduled( uint64_t at, uint32_t queued )
+{
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"at\" : %llu, \"queued\" : %u }\n",
+									(unsigned long long)at, queued );
+	return uts_dup_free(s);
+}
+
+/* sim time [now], as seconds and usec, and the wall clock times of
+	 the exchange: [t0] the client's send time it gave us, [t1] our
+	 receive time and [t2] our reply time */
+char* xdr_format_clock( av_t* av, uint64_t t0, uint64_t t1, uint64_t t2, uint64_t now )
+{
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"time\" : %llu.%06llu, \"usec\" : %llu, "
+									"\"t0\" : %llu, \"t1\" : %llu, \"t2\" : %llu, ",
+									(unsigned long long)( now / 1000000 ), 
+									(unsigned long long)( now % 1000000 ),
+									(unsigned long long)now,
+									(unsigned long long)t0, (unsigned long long)t1, (unsigned long long)t2 );
+
+	if( av->run_steps )
+		utstring_printf(s, "\"run\" : \"stepping\", \"steps\" : %u }\n", av->run_steps );
+	else if( av->run_until == UINT64_MAX )
+		utstring_printf(s, "\"run\" : \"free\" }\n" );
+	else
+		utstring_printf(s, "\"run\" : \"%s\", \"until\" : %llu }\n",
+										now < av->run_until ? "running" : "held",
+										(unsigned long long)av->run_until );
+	return uts_dup_free(s);
+}
+
+/* the owner of every mirrored model */
+char* xdr_format_owners( av_t* av )
+{
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"owners\" : [" );
+	
+	for( _av_owner_t* own = av->owners; own; own = own->hh.next )
+		utstring_printf(s, "%s[\"%s\",\"%s\"]", own == av->owners ? "" : ",",
+										own->model, own->owner );
+	
+	utstring_printf(s, "] }\n" );
+	return uts_dup_free(s);
+}
+
+/* a proposed partition, as JSON or, if [fed], as the member sections
+	 of a federation file */
+char* xdr_format_partition( const _av_partition_t* part, int fed )
+{
+  UT_string* s = uts_new();
+
+	if( fed )
+		{
+			for( uint32_t m=0; m<part->member_count; m++ )
+				{
+					utstring_printf(s, "[%s]\n", part->members[m] );
+					for( uint32_t i=0; i<part->count; i++ )
+						{
+							const _av_placement_t* it = &part->items[i];
+							if( it->proposed != part->members[m] )
+								continue;
+
+							// mirrored into every other member that has it
+							utstring_printf(s, "%s=", it->own->model );
+							const char* sep = "";
+							if( it->own->owner != it->proposed )
+								{
+									utstring_printf(s, "%s:%s", it->own->owner, it->own->prototype );
+									sep = ";";
+								}
+							for( unsigned j=0; j<utarray_len( it->own->mirrors ); j++ )
+								{
+									const char* name = *(const char**)utarray_eltptr( it->own->mirrors, j );
+									if( name == it->proposed )
+										continue;
+									utstring_printf(s, "%s%s:%s", sep, name, it->own->prototype );
+									sep = ";";
+								}
+							utstring_printf(s, "\n" );
+						}
+					utstring_printf(s, "\n" );
+				}
+			return uts_dup_free(s);
+		}
+
+	utstring_printf(s, "{ \"members\" : [" );
+	for( uint32_t m=0; m<part->member_count; m++ )
+		utstring_printf(s, "%s\"%s\"", m ? "," : "", part->members[m] );
+	utstring_printf(s, "], \"models\" : [" );
+	for( uint32_t i=0; i<part->count; i++ )
+		{
+			const _av_placement_t* it = &part->items[i];
+			utstring_printf(s, "%s\n { \"name\" : \"%s\", \"owner\" : \"%s\", "
+											"\"proposed\" : \"%s\", \"margin\" : %.3f, \"migrate\" : %s }",
+											i ? "," : "", it->own->model, it->own->owner, it->proposed,
+											isinf( it->margin ) ? -1.0 : it->margin, it->migrate ? "true" : "false" );
+		}
+	utstring_printf(s, " ] }\n" );
+	return uts_dup_free(s);
+}
+
+/* the models detecting fiducial [id], from its index entry [seen],
+	 which is NULL if none do */
+char* xdr_format_seen( av_t* av, uint64_t id, const _av_seen_t* seen )
+{
+	assert(av);
+
+	const uint32_t n = seen ? utarray_len( seen->sightings ) : 0;
+
+  UT_string* s = uts_new();
+	utstring_printf(s, "{ \"id\" : %llu, \"observer_count\" : %u, \"observers\" : [", 
+									(unsigned long long)id, n );
+	
+	for( uint32_t i=0; i<n; i++ )
+		{
+			const _av_sighting_t* sg = 
+				(_av_sighting_t*)utarray_eltptr( seen->sightings, i );
+			
+			if( i > 0 )				
+				utstring_printf(s, "," );		
+			
+			utstring_printf(s, "\n { \"name\" : \"%s\", ", _av_node_at( av, sg->node )->id );
+			print_named_double_array( s, "pose", sg->pose, 3, " }" );
+		}
+	
+	utstring_printf(s, " ] }\n" );
+	return uts_dup_free(s);
+}
+
 char* xdr_format_pva( const av_pva_t* pva )
 {
   assert(pva);
@@ -147,36 +443,421 @@ char* xdr_format_geom( const av_geom_t* g )
 }
 
 
-char* xdr_format_data_ranger( av_msg_t* d )
+/** Returns a pointer to the [index]th element of a strided buffer */
+static inline const void* stride_at( const void* base, size_t stride, uint32_t index )
 {
-  assert(d);
-  assert(d->interface == AV_INTERFACE_RANGER);
-  assert(d->data);
-  const av_ranger_data_t* rd = d->data;
+  return (const char*)base + (size_t)index * stride;
+}
+
+static const _av_data_opts_t _data_opts_all = 
+  { UINT64_MAX, 0, 1, 0, { 0, 0 }, AV_FRAME_SENSOR, NULL, AV_REDUCE_NONE, 1, 0 };
+
+/* a view may hold more transducers than the mask has bits. Those are
+	 included unless ?transducers= chose some, which only accepts
+	 indices below AV_RANGER_TRANSDUCERS_MAX. */
+static inline int transducer_selected( const _av_data_opts_t* opts, uint32_t i )
+{
+  if( ! opts->transducers_set )
+	 return 1;
+  return( i < AV_RANGER_TRANSDUCERS_MAX && (opts->transducers >> i) & 1 );
+}
+
+/* widen samples [j], [j+stride], .. of [tv] into [rows] as BARI
+	 doubles, up to AV_ELEMENT_BLOCK of them, for the reductions and
+	 point clouds, which compute in double anyway. Each element type has
+	 its own loop here, so the loops over the rows never look at the
+	 type. Returns the number of rows filled, 0 once [j] is past the
+	 end. */
+static uint32_t sample_block( const av_ranger_transducer_view_t* tv, 
+										uint32_t j, uint32_t stride,
+										double rows[AV_ELEMENT_BLOCK][4] )
+{
+  uint32_t n = 0;
+  switch( tv->type )
+	 {
+	 case AV_ELEMENT_DOUBLE:
+		for( ; n<AV_ELEMENT_BLOCK && j<tv->sample_count; n++, j += stride )
+		  memcpy( rows[n], stride_at( tv->samples, tv->stride, j ), sizeof(rows[n]) );
+		break;
+	 case AV_ELEMENT_FLOAT:
+		for( ; n<AV_ELEMENT_BLOCK && j<tv->sample_count; n++, j += stride )
+		  {
+			 const float* f = stride_at( tv->samples, tv->stride, j );
+			 for( int k=0; k<4; k++ )
+				rows[n][k] = f[k];
+		  }
+		break;
+	 default:
+		assert(0);
+	 }
+  return n;
+}
+
+/* true if bearing [b] is within the requested bearings */
+static inline int bearing_selected( const _av_data_opts_t* opts, double b )
+{
+  return( ! opts->bearing_set || 
+			 ( b >= opts->bearing[0] && b <= opts->bearing[1] ) );
+}
+
+/* true if sample [row] is selected and detected something. Zero
+	 intensity means the beam saw nothing, so its range is meaningless
+	 to a reduction. */
+static inline int row_valid( const _av_data_opts_t* opts, const double row[4] )
+{
+  return( bearing_selected( opts, row[AV_SAMPLE_BEARING] ) && 
+			 row[AV_SAMPLE_INTENSITY] != 0 );
+}
+
+/* the number of samples of [tv] that [opts] selects */
+static uint32_t samples_selected( const av_ranger_transducer_view_t* tv, 
+											 const _av_data_opts_t* opts )
+{
+  if( ! opts->bearing_set )
+	 return ( (uint64_t)tv->sample_count + opts->stride - 1 ) / opts->stride;
+
+  // only the bearings are needed, so read them in place
+  uint32_t count = 0;
+  switch( tv->type )
+	 {
+	 case AV_ELEMENT_DOUBLE:
+		for( uint32_t j=0; j<tv->sample_count; j += opts->stride )
+		  {
+			 const double* v = stride_at( tv->samples, tv->stride, j );
+			 count += bearing_selected( opts, v[AV_SAMPLE_BEARING] );
+		  }
+		break;
+	 case AV_ELEMENT_FLOAT:
+		for( uint32_t j=0; j<tv->sample_count; j += opts->stride )
+		  {
+			 const float* v = stride_at( tv->samples, tv->stride, j );
+			 count += bearing_selected( opts, v[AV_SAMPLE_BEARING] );
+		  }
+		break;
+	 default:
+		assert(0);
+	 }
+  return count;
+}
+
+static void print_reduce_min( UT_string* s, 
+										const av_ranger_transducer_view_t* tv,
+										const _av_data_opts_t* opts )
+{
+  double rows[AV_ELEMENT_BLOCK][4];
+
+  // sectors divide the requested bearings, or else those observed
+  double lo = opts->bearing[0], hi = opts->bearing[1];
+  if( ! opts->bearing_set )
+	 {
+		lo = INFINITY; 
+		hi = -INFINITY;
+		for( uint32_t j=0, n; (n = sample_block( tv, j, opts->stride, rows )) > 0; )
+		  {
+			 for( uint32_t b=0; b<n; b++, j += opts->stride )
+				{
+				  const double bearing = rows[b][AV_SAMPLE_BEARING];
+				  if( bearing < lo ) lo = bearing;
+				  if( bearing > hi ) hi = bearing;
+				}
+		  }
+		if( lo > hi ) // no samples
+		  lo = hi = 0;
+	 }
+  const double width = (hi - lo) / opts->bins;
   
+  double mins[AV_RANGER_SAMPLES_MAX];
+  for( uint32_t k=0; k<opts->bins; k++ )
+	 mins[k] = INFINITY;
+  
+  for( uint32_t j=0, n; (n = sample_block( tv, j, opts->stride, rows )) > 0; )
+	 {
+		for( uint32_t b=0; b<n; b++, j += opts->stride )
+		  if( row_valid( opts, rows[b] ) )
+			 {
+				uint32_t k = 0;
+				if( width > 0 )
+				  {
+					 const double f = (rows[b][AV_SAMPLE_BEARING] - lo) / width;
+					 k = f < 0 ? 0 : f >= opts->bins ? opts->bins - 1 : (uint32_t)f;
+				  }
+				const double r = rows[b][AV_SAMPLE_RANGE];
+				if( r < mins[k] )
+				  mins[k] = r;
+			 }
+	 }
+  
+  utstring_printf(s, " \"sectors\" : [" );
+  for( uint32_t k=0; k<opts->bins; k++ )
+	 {
+		if( k > 0 )
+		  utstring_printf(s, "," );
+		utstring_printf(s, "[%.3f,%.3f,", lo + k*width, lo + (k+1)*width );
+		if( isinf( mins[k] ) )
+		  utstring_printf(s, "null]" );
+		else
+		  utstring_printf(s, "%.3f]", mins[k] );
+	 }
+  utstring_printf(s, "]" );
+}
+
+static void print_reduce_histogram( UT_string* s, 
+												const av_ranger_transducer_view_t* tv,
+												const _av_data_opts_t* opts )
+{
+  double rows[AV_ELEMENT_BLOCK][4];
+  double max = opts->hist_max;
+  if( max <= 0 )
+	 for( uint32_t j=0, n; (n = sample_block( tv, j, opts->stride, rows )) > 0; )
+		{
+		  for( uint32_t b=0; b<n; b++, j += opts->stride )
+			 if( row_valid( opts, rows[b] ) && rows[b][AV_SAMPLE_RANGE] > max )
+				max = rows[b][AV_SAMPLE_RANGE];
+		}
+  const double width = max / opts->bins;
+  
+  uint32_t counts[AV_RANGER_SAMPLES_MAX];
+  memset( counts, 0, opts->bins * sizeof(uint32_t) );
+  uint32_t over = 0;
+  
+  for( uint32_t j=0, n; (n = sample_block( tv, j, opts->stride, rows )) > 0; )
+	 {
+		for( uint32_t b=0; b<n; b++, j += opts->stride )
+		  if( row_valid( opts, rows[b] ) )
+			 {
+				const double r = rows[b][AV_SAMPLE_RANGE];
+				if( r > max )
+				  over++;
+				else if( width <= 0 || r < 0 )
+				  counts[0]++;
+				else
+				  {
+					 const uint32_t k = r / width;
+					 counts[ k < opts->bins ? k : opts->bins - 1 ]++;
+				  }
+			 }
+	 }
+  
+  utstring_printf(s, " \"bin_width\" : %.3f, \"over\" : %u, \"counts\" : [", 
+						width, over );
+  for( uint32_t k=0; k<opts->bins; k++ )
+	 utstring_printf(s, k > 0 ? ",%u" : "%u", counts[k] );
+  utstring_printf(s, "]" );
+}
+
+/* a reduction of the selected samples, which is a few bytes however
+	 many samples there are */
+static char* xdr_format_ranger_reduce( const av_ranger_view_t* rv, 
+													const _av_data_opts_t* opts )
+{
+  static const char* names[] = { "none", "min", "nearest", "histogram" };
+
   UT_string* s = uts_new();
   utstring_printf(s, "{ " );
-  uts_print_time(s, d->time );
+  uts_print_time(s, rv->time );
   utstring_printf(s, ",\n" );
   utstring_printf(s, " \"interface\" : \"ranger\", \n" );
-  utstring_printf(s, " \"transducer_count\" : %u, \n", rd->transducer_count );
+  utstring_printf(s, " \"reduction\" : \"%s\", \n", names[opts->reduce] );
+  
+  if( opts->reduce == AV_REDUCE_NEAREST )
+	 {
+		int found = 0;
+		uint32_t bi = 0, bj = 0;
+		double best[4] = { 0, 0, INFINITY, 0 };
+		double rows[AV_ELEMENT_BLOCK][4];
+		for( uint32_t i=0; i<rv->transducer_count; i++ )
+		  {
+			 if( ! transducer_selected( opts, i ) )
+				continue;
+			 const av_ranger_transducer_view_t* tv = &rv->transducers[i];
+			 for( uint32_t j=0, n; (n = sample_block( tv, j, opts->stride, rows )) > 0; )
+				{
+				  for( uint32_t b=0; b<n; b++, j += opts->stride )
+					 if( row_valid( opts, rows[b] ) && 
+						  rows[b][AV_SAMPLE_RANGE] < best[AV_SAMPLE_RANGE] )
+						{
+						  memcpy( best, rows[b], sizeof(best) );
+						  bi = i;
+						  bj = j;
+						  found = 1;
+						}
+				}
+		  }
+		
+		if( found )
+		  utstring_printf(s, " \"nearest\" : { \"index\" : %u, \"sample\" : %u, "
+							  "\"bearing\" : %.3f, \"azimuth\" : %.3f, \"range\" : %.3f } }\n",
+							  bi, bj,
+							  best[AV_SAMPLE_BEARING],
+							  best[AV_SAMPLE_AZIMUTH],
+							  best[AV_SAMPLE_RANGE] );
+		else
+		  utstring_printf(s, " \"nearest\" : null }\n" );
+		
+		return uts_dup_free(s);
+	 }
+  
   utstring_printf(s, " \"transducers\" : [\n" );
+  int first = 1;
+  for( uint32_t i=0; i<rv->transducer_count; i++ )
+	 {
+		if( ! transducer_selected( opts, i ) )
+		  continue;
+		if( ! first )				
+		  utstring_printf(s, ",\n" );		
+		first = 0;
+		
+		utstring_printf(s, "{ \"index\" : %u,", i );
+		if( opts->reduce == AV_REDUCE_MIN )
+		  print_reduce_min( s, &rv->transducers[i], opts );
+		else
+		  print_reduce_histogram( s, &rv->transducers[i], opts );
+		utstring_printf(s, " }" );
+	 }
+  utstring_printf(s, " ]" );
+  utstring_printf(s, " }\n" );
   
-  for( int i=0; i<rd->transducer_count; i++ )
+  return uts_dup_free(s);
+}
+
+/* the selected samples of transducer [t] as cartesian points
+	 [x,y,z,intensity] in the frame requested by [opts] */
+static void print_ranger_points( UT_string* s, 
+											const av_ranger_transducer_view_t* tv,
+											uint32_t t, 
+											const _av_data_opts_t* opts )
+{
+  assert( opts->node );
+
+  double origin[3], rot[9];
+  spatial_sensor_frame( opts->node, tv->pose, opts->frame == AV_FRAME_WORLD, 
+								origin, rot );
+  
+  _av_sensor_t* sensor = sensor_of( opts->node->av, opts->node );
+  assert( sensor );
+  _av_beam_t* beams = spatial_beams( sensor, t, tv->sample_count );
+
+  int first = 1;
+  double rows[AV_ELEMENT_BLOCK][4];
+  for( uint32_t j=0, n; (n = sample_block( tv, j, opts->stride, rows )) > 0; )
 	 {
-		if( i > 0 )				
+		for( uint32_t i=0; i<n; i++, j += opts->stride )
+		  {
+			 const double* bari = rows[i];
+			 if( ! bearing_selected( opts, bari[AV_SAMPLE_BEARING] ) )
+				continue;
+		
+			 // a fixed-fov scanner reports the same angles every scan, so
+			 // the trig is usually cached
+			 _av_beam_t* b = &beams[j];
+			 if( b->bearing != bari[AV_SAMPLE_BEARING] || 
+				  b->azimuth != bari[AV_SAMPLE_AZIMUTH] )
+			   {
+				  b->bearing = bari[AV_SAMPLE_BEARING];
+				  b->azimuth = bari[AV_SAMPLE_AZIMUTH];
+				  const double ca = cos(b->azimuth);
+				  b->dir[0] = ca * cos(b->bearing);
+				  b->dir[1] = ca * sin(b->bearing);
+				  b->dir[2] = sin(b->azimuth);
+			   }
+		
+			 const double r = bari[AV_SAMPLE_RANGE];
+			 double pt[4];
+			 for( int k=0; k<3; k++ )
+			   pt[k] = origin[k] + r * ( rot[3*k] * b->dir[0] + 
+												  rot[3*k+1] * b->dir[1] + 
+												  rot[3*k+2] * b->dir[2] );
+			 pt[3] = bari[AV_SAMPLE_INTENSITY];
+
+			 if( ! first )
+			   utstring_printf(s, "," );
+			 first = 0;
+			 print_double_array( s, pt, 4 );
+		  }
+	 }
+}
+
+static char* xdr_format_ranger_view( const av_ranger_view_t* rv, 
+												 const _av_data_opts_t* opts )
+{
+  if( opts->reduce != AV_REDUCE_NONE )
+	 return xdr_format_ranger_reduce( rv, opts );
+
+  uint32_t transducer_count = 0;
+  for( uint32_t i=0; i<rv->transducer_count; i++ )
+	 if( transducer_selected( opts, i ) )
+		transducer_count++;
+
+  UT_string* s = uts_new();
+  utstring_printf(s, "{ " );
+  uts_print_time(s, rv->time );
+  utstring_printf(s, ",\n" );
+  utstring_printf(s, " \"interface\" : \"ranger\", \n" );
+  if( opts->frame != AV_FRAME_SENSOR )
+	 utstring_printf(s, " \"frame\" : \"%s\", \n", 
+						  opts->frame == AV_FRAME_WORLD ? "world" : "local" );
+  utstring_printf(s, " \"transducer_count\" : %u, \n", transducer_count );
+  utstring_printf(s, " \"transducers\" : [\n" );
+  
+  int first = 1;
+  for( uint32_t i=0; i<rv->transducer_count; i++ )
+	 {
+		if( ! transducer_selected( opts, i ) )
+		  continue;
+
+		const av_ranger_transducer_view_t* tv = &rv->transducers[i];
+		
+		if( ! first )				
 		  utstring_printf(s, ",\n" );		
+		first = 0;
+
+		const uint32_t sample_count = samples_selected( tv, opts );
+
+		utstring_printf( s, "{ \"index\" : %u, ", i ) ;
+		print_named_double_array( s, "pose", tv->pose, 6, "," );
+		utstring_printf(s, " \"sample_count\" : %u, ", sample_count );
+
+		if( opts->frame != AV_FRAME_SENSOR )
+		  {
+			 utstring_printf(s, " \"points\" : [" );
+			 print_ranger_points( s, tv, i, opts );
+			 utstring_printf(s, " ] }" );
+			 continue;
+		  }
 
-		utstring_printf( s, "{ ") ;
-		print_named_double_array( s, "pose", rd->transducers[i].pose, 6, "," );
-		utstring_printf(s, " \"sample_count\" : %u, ", rd->transducers[i].sample_count );
 		utstring_printf(s, " \"samples\" : [" );
 		
-		for( int j=0; j<rd->transducers[i].sample_count;  j++ )
+		// one loop per element type keeps the conversion out of the
+		// inner loop
+		int first_sample = 1;
+		switch( tv->type )
 		  {
-			 if( j > 0 )				
-				utstring_printf(s, "," );		
-			 print_double_array( s, rd->transducers[i].samples[j], 4 );			 
+		  case AV_ELEMENT_DOUBLE:
+			 for( uint32_t j=0; j<tv->sample_count;  j += opts->stride )
+				{
+				  const double* v = stride_at( tv->samples, tv->stride, j );
+				  if( ! bearing_selected( opts, v[AV_SAMPLE_BEARING] ) )
+					 continue;
+				  if( ! first_sample )				
+					 utstring_printf(s, "," );		
+				  first_sample = 0;
+				  print_double_array( s, v, 4 );
+				}
+			 break;
+		  case AV_ELEMENT_FLOAT:
+			 for( uint32_t j=0; j<tv->sample_count;  j += opts->stride )
+				{
+				  const float* v = stride_at( tv->samples, tv->stride, j );
+				  if( ! bearing_selected( opts, v[AV_SAMPLE_BEARING] ) )
+					 continue;
+				  if( ! first_sample )				
+					 utstring_printf(s, "," );		
+				  first_sample = 0;
+				  print_float_array( s, v, 4 );
+				}
+			 break;
+		  default:
+			 assert(0);
 		  }
 		utstring_printf(s, " ]" );
 		utstring_printf(s, " }" );
@@ -187,6 +868,38 @@ char* xdr_format_data_ranger( av_msg_t* d )
   return uts_dup_free(s);
 }
 
+char* xdr_format_data_ranger( av_msg_t* d, const _av_data_opts_t* opts )
+{
+  assert(d);
+  assert(d->interface == AV_INTERFACE_RANGER);
+  assert(d->data);
+
+  if( d->layout == AV_MSG_VIEW )
+	 {
+		av_ranger_view_t rv = *(const av_ranger_view_t*)d->data;
+		if( rv.time == 0 )
+		  rv.time = d->time;
+		return xdr_format_ranger_view( &rv, opts ? opts : &_data_opts_all );
+	 }
+
+  // describe the fixed struct as a view so there is only one encoder
+  const av_ranger_data_t* rd = d->data;
+  assert( rd->transducer_count <= AV_RANGER_TRANSDUCERS_MAX );
+
+  av_ranger_transducer_view_t tv[AV_RANGER_TRANSDUCERS_MAX];
+  for( int i=0; i<rd->transducer_count; i++ )
+	 {
+		memcpy( tv[i].pose, rd->transducers[i].pose, sizeof(tv[i].pose) );
+		tv[i].sample_count = rd->transducers[i].sample_count;
+		tv[i].samples = rd->transducers[i].samples;
+		tv[i].stride = sizeof(rd->transducers[i].samples[0]);
+		tv[i].type = AV_ELEMENT_DOUBLE;
+	 }
+
+  av_ranger_view_t rv = { d->time, rd->transducer_count, tv };
+  return xdr_format_ranger_view( &rv, opts ? opts : &_data_opts_all );
+}
+
 char* xdr_format_cfg_ranger( av_msg_t* d )
 {
   assert(d);
@@ -257,47 +970,220 @@ char* xdr_format_cfg_fiducial( av_msg_t* d )
   return uts_dup_free(s);
 }
 
-static char* xdr_format_fiducial( const av_fiducial_t* f )
+/* describes the fiducials in [d] as a view, whatever its layout */
+void fiducial_view( const av_msg_t* d, av_fiducial_view_t* fid )
 {
-  UT_string* s = uts_new();
-  utstring_printf(s, "{ " );	
-	print_named_double_array( s, "pose", f->pose, 3, ", " );
-	char* g = xdr_format_geom( &f->geom );		
-	utstring_printf(s, "\"geom\" : \"%s\"", g );
-	free(g);
-  utstring_printf(s, "}" );
-  return uts_dup_free(s);
+  if( d->layout == AV_MSG_VIEW )
+	 {
+		*fid = *(const av_fiducial_view_t*)d->data;
+		if( fid->time == 0 )
+		  fid->time = d->time;
+	 }
+  else
+	 {
+		const av_fiducial_data_t* fd = d->data;
+		fid->time = d->time;
+		fid->fiducial_count = fd->fiducial_count;
+		fid->fiducials = fd->fiducials;
+		fid->stride = sizeof(av_fiducial_t);
+		fid->type = AV_ELEMENT_DOUBLE;
+	 }
 }
 
-char* xdr_format_data_fiducial( av_msg_t* d )
+/* widen fiducials [i], [i+1], .. of [fid] into [recs], up to
+	 AV_ELEMENT_BLOCK of them, with one loop per element type, for the
+	 fiducial index, which keeps its poses as doubles. The encoders read
+	 the records directly instead. Returns the number of records filled,
+	 0 once [i] is past the end. */
+uint32_t fiducial_block( const av_fiducial_view_t* fid, uint32_t i, 
+								 _av_fiducial_rec_t recs[AV_ELEMENT_BLOCK] )
+{
+  uint32_t n = 0;
+  switch( fid->type )
+	 {
+	 case AV_ELEMENT_DOUBLE:
+		for( ; n<AV_ELEMENT_BLOCK && i<fid->fiducial_count; n++, i++ )
+		  {
+			 const av_fiducial_t* f = stride_at( fid->fiducials, fid->stride, i );
+			 _av_fiducial_rec_t* r = &recs[n];
+			 r->id = f->id;
+			 memcpy( r->pose, f->pose, sizeof(r->pose) );
+			 memcpy( r->geom_pose, f->geom.pose, sizeof(r->geom_pose) );
+			 memcpy( r->geom_extent, f->geom.extent, sizeof(r->geom_extent) );
+		  }
+		break;
+	 case AV_ELEMENT_FLOAT:
+		for( ; n<AV_ELEMENT_BLOCK && i<fid->fiducial_count; n++, i++ )
+		  {
+			 const av_fiducial_float_t* f = stride_at( fid->fiducials, fid->stride, i );
+			 _av_fiducial_rec_t* r = &recs[n];
+			 r->id = f->id;
+			 for( int k=0; k<3; k++ ) r->pose[k] = f->pose[k];
+			 for( int k=0; k<6; k++ ) r->geom_pose[k] = f->geom.pose[k];
+			 for( int k=0; k<3; k++ ) r->geom_extent[k] = f->geom.extent[k];
+		  }
+		break;
+	 default:
+		assert(0);
+	 }
+  return n;
+}
+
+static inline int fiducial_selected( const _av_data_opts_t* opts, 
+												 uint64_t id, double range )
+{
+  if( opts->id_set && id != opts->id )
+	 return 0;
+  if( opts->max_range > 0 && range > opts->max_range )
+	 return 0;
+  return 1;
+}
+
+char* xdr_format_data_fiducial( av_msg_t* d, const _av_data_opts_t* opts )
 {
   assert(d);
   assert(d->interface == AV_INTERFACE_FIDUCIAL);
   assert(d->data);
-  const av_fiducial_data_t* fid = d->data;
+  if( opts == NULL )
+	 opts = &_data_opts_all;
+
+  av_fiducial_view_t fid;
+  fiducial_view( d, &fid );
 
+  // the detections go into one string in a single pass, with no
+  // allocation per detection. The count is known only at the end, so
+  // the header is formatted then and joined to them.
   UT_string* s = uts_new();
-  utstring_printf(s, "{ " );
-  uts_print_time(s, d->time );
-  utstring_printf(s, ",\n" );
-  utstring_printf(s, " \"interface\" : \"fiducial\", \n" );
-  utstring_printf(s, " \"fiducial_count\" : %u, \n", fid->fiducial_count );
   utstring_printf(s, " \"fiducials\" : [\n" );
   
-  for( int i=0; i<fid->fiducial_count; i++ )
+  // one loop per element type, each formatting straight from the
+  // simulator's records
+  uint32_t count = 0;
+  switch( fid.type )
 	 {
-		 if( i > 0 )				
-		  utstring_printf(s, ",\n" );		
-		 
-		 char* f = xdr_format_fiducial( &fid->fiducials[i] );
-		 utstring_printf( s, "%s", f );
-		 free(f);
+	 case AV_ELEMENT_DOUBLE:
+		for( uint32_t i=0; i<fid.fiducial_count; i++ )
+		  {
+			 const av_fiducial_t* f = stride_at( fid.fiducials, fid.stride, i );
+			 if( ! fiducial_selected( opts, f->id, f->pose[2] ) )
+				continue;
+
+			 if( count++ )				
+				utstring_printf(s, ",\n" );		
+		
+			 utstring_printf(s, "{ \"id\" : %llu, ", (unsigned long long)f->id );
+			 print_named_double_array( s, "pose", f->pose, 3, ", " );
+			 utstring_printf(s, "\"geom\" : { " );
+			 print_named_double_array( s, "pose", f->geom.pose, 6, ", " );
+			 print_named_double_array( s, "extent", f->geom.extent, 3, " } }" );
+		  }
+		break;
+	 case AV_ELEMENT_FLOAT:
+		for( uint32_t i=0; i<fid.fiducial_count; i++ )
+		  {
+			 const av_fiducial_float_t* f = stride_at( fid.fiducials, fid.stride, i );
+			 if( ! fiducial_selected( opts, f->id, f->pose[2] ) )
+				continue;
+
+			 if( count++ )				
+				utstring_printf(s, ",\n" );		
+		
+			 utstring_printf(s, "{ \"id\" : %llu, ", (unsigned long long)f->id );
+			 print_named_float_array( s, "pose", f->pose, 3, ", " );
+			 utstring_printf(s, "\"geom\" : { " );
+			 print_named_float_array( s, "pose", f->geom.pose, 6, ", " );
+			 print_named_float_array( s, "extent", f->geom.extent, 3, " } }" );
+		  }
+		break;
+	 default:
+		assert(0);
 	 }
   utstring_printf(s, " ]" );
   utstring_printf(s, " }\n" );
   
-  return uts_dup_free(s);
+  UT_string* head = uts_new();
+  utstring_printf(head, "{ " );
+  uts_print_time(head, fid.time );
+  utstring_printf(head, ",\n" );
+  utstring_printf(head, " \"interface\" : \"fiducial\", \n" );
+  utstring_printf(head, " \"fiducial_count\" : %u, \n", count );
 
+  char* buf = malloc( utstring_len(head) + utstring_len(s) + 1 );
+  assert(buf);
+  memcpy( buf, utstring_body(head), utstring_len(head) );
+  memcpy( buf + utstring_len(head), utstring_body(s), utstring_len(s) + 1 );
+  utstring_free(head);
+  utstring_free(s);
+  return buf; // caller must free
+}
+
+/* the selected fiducials in the packed layout described in avon.h, in
+	 the element type of the simulator's records, which are copied
+	 without conversion. Stores the size in [len]. Caller must free. */
+void* xdr_pack_data_fiducial( av_msg_t* d, const _av_data_opts_t* opts, 
+										size_t* len )
+{
+  assert(d);
+  assert(d->interface == AV_INTERFACE_FIDUCIAL);
+  assert(d->data);
+  assert(len);
+  if( opts == NULL )
+	 opts = &_data_opts_all;
+
+  av_fiducial_view_t fid;
+  fiducial_view( d, &fid );
+
+  const size_t size = fid.type == AV_ELEMENT_FLOAT ? 
+	 AV_FIDUCIAL_PACKED_FLOAT_SIZE : AV_FIDUCIAL_PACKED_DOUBLE_SIZE;
+  uint8_t* buf = malloc( AV_FIDUCIAL_PACKED_HEADER + fid.fiducial_count * size );
+  assert(buf);
+  
+  uint8_t* p = buf + AV_FIDUCIAL_PACKED_HEADER;
+  uint32_t count = 0;
+  switch( fid.type )
+	 {
+	 case AV_ELEMENT_DOUBLE:
+		for( uint32_t i=0; i<fid.fiducial_count; i++ )
+		  {
+			 const av_fiducial_t* f = stride_at( fid.fiducials, fid.stride, i );
+			 if( ! fiducial_selected( opts, f->id, f->pose[2] ) )
+				continue;
+
+			 memcpy( p, &f->id, 8 );
+			 memcpy( p + 8, f->pose, 3*8 );
+			 memcpy( p + 32, f->geom.pose, 6*8 );
+			 memcpy( p + 80, f->geom.extent, 3*8 );
+			 p += AV_FIDUCIAL_PACKED_DOUBLE_SIZE;
+			 count++;
+		  }
+		break;
+	 case AV_ELEMENT_FLOAT:
+		for( uint32_t i=0; i<fid.fiducial_count; i++ )
+		  {
+			 const av_fiducial_float_t* f = stride_at( fid.fiducials, fid.stride, i );
+			 if( ! fiducial_selected( opts, f->id, f->pose[2] ) )
+				continue;
+
+			 memcpy( p, &f->id, 8 );
+			 memcpy( p + 8, f->pose, 3*4 );
+			 memcpy( p + 20, f->geom.pose, 6*4 );
+			 memcpy( p + 44, f->geom.extent, 3*4 );
+			 p += AV_FIDUCIAL_PACKED_FLOAT_SIZE;
+			 count++;
+		  }
+		break;
+	 default:
+		assert(0);
+	 }
+  
+  const uint64_t time = fid.time;
+  const uint32_t type = fid.type;
+  memcpy( buf, &time, sizeof(time) );
+  memcpy( buf + 8, &count, sizeof(count) );
+  memcpy( buf + 12, &type, sizeof(type) );
+  
+  *len = p - buf;
+  return buf;
 }
 
 void unpack_json_double_array( json_object* job, double* arr, const size_t len )
@@ -325,10 +1211,157 @@ void unpack_json_pva( json_object* job, av_pva_t* pva )
   unpack_json_double_array( a_array, pva->a, 6 );
 }
 
+// json-c before 0.11 returns an error pointer, not NULL, on bad input
+#ifndef is_error
+#define is_error(ptr) ((ptr) == NULL)
+#endif
+
+/* parses [buf] into a JSON object. Returns NULL if it is malformed or
+	 not an object, e.g. a request body from a confused peer. */
+static json_object* parse_object( const char* buf )
+{
+  json_object* job = json_tokener_parse( buf );
+  if( job == NULL || is_error( job ) )
+	 return NULL;
+
+  if( !json_object_is_type( job, json_type_object ) )
+	 {
+		json_object_put( job );
+		return NULL;
+	 }
+  return job;
+}
+
+static int is_number( json_object* job )
+{
+  return json_object_is_type( job, json_type_double ) || 
+	 json_object_is_type( job, json_type_int );
+}
+
+/* stores the non-negative integer [job] in [val]. Returns 0 on
+	 success, -1 if it is anything else. Reads the number's text rather
+	 than json_object_get_int64(), which json-c 0.9 lacks. */
+static int get_uint64( json_object* job, uint64_t* val )
+{
+  if( job == NULL || !json_object_is_type( job, json_type_int ) )
+	 return -1;
+
+  const char* s = json_object_get_string( job );
+  char* end = NULL;
+  if( s == NULL || *s < '0' || *s > '9' ) // no sign
+	 return -1;
+  *val = strtoull( s, &end, 10 );
+  return *end ? -1 : 0;
+}
+
+/* parses regions of interest from xdr_format_interest(), storing the
+	 sender's name in [name]. Returns the regions, which the caller
+	 must free, or NULL on error. */
+UT_array* xdr_parse_interest( const char* buf, char* name, size_t len )
+{
+  json_object* job = parse_object( buf );
+  if( job == NULL )
+	 return NULL;
+
+  json_object* peer = json_object_object_get( job, "peer" );
+  json_object* regions = json_object_object_get( job, "regions" );
+  if( peer == NULL || regions == NULL || 
+		!json_object_is_type( regions, json_type_array ) )
+	 {
+		json_object_put( job );
+		return NULL;
+	 }
+  snprintf( name, len, "%s", json_object_get_string( peer ) );
+
+  UT_array* out;
+  utarray_new( out, &_av_circle_icd );
+  for( int i=0; i<json_object_array_length( regions ); i++ )
+	 {
+		json_object* r = json_object_array_get_idx( regions, i );
+		int ok = json_object_is_type( r, json_type_array ) && json_object_array_length( r ) == 3;
+		for( int j=0; ok && j<3; j++ )
+		  ok = is_number( json_object_array_get_idx( r, j ) );
+
+		double v[3];
+		if( ok )
+		  unpack_json_double_array( r, v, 3 );
+		if( !ok || !( v[2] >= 0 ) ) // a negative or NaN radius is nonsense
+		  {
+			 utarray_free( out );
+			 json_object_put( job );
+			 return NULL;
+		  }
+
+		_av_circle_t c = { v[0], v[1], v[2] };
+		utarray_push_back( out, &c );
+	 }
+
+  json_object_put( job );
+  return out;
+}
+
+/* parses a clock and lookahead from xdr_format_sync(), storing the
+	 sender's name in [name]. Returns 0 on success, -1 on error. */
+int xdr_parse_sync( const char* buf, char* name, size_t len, 
+										uint64_t* time, uint64_t* lookahead )
+{
+  json_object* job = parse_object( buf );
+  if( job == NULL )
+	 return -1;
+
+  json_object* peer = json_object_object_get( job, "peer" );
+  json_object* t = json_object_object_get( job, "time" );
+  json_object* l = json_object_object_get( job, "lookahead" );
+  if( peer == NULL || get_uint64( t, time ) != 0 || get_uint64( l, lookahead ) != 0 )
+	 {
+		json_object_put( job );
+		return -1;
+	 }
+
+  snprintf( name, len, "%s", json_object_get_string( peer ) );
+  json_object_put( job );
+  return 0;
+}
+
+/* parses model owners from xdr_format_owners(), passing each model
+	 and owner to [fn]. Returns 0 on success, -1 on error. */
+int xdr_parse_owners( const char* buf, av_t* av, 
+											int (*fn)( av_t*, const char*, const char* ) )
+{
+  json_object* job = parse_object( buf );
+  if( job == NULL )
+	 return -1;
+
+  json_object* owners = json_object_object_get( job, "owners" );
+  if( owners == NULL || !json_object_is_type( owners, json_type_array ) )
+	 {
+		json_object_put( job );
+		return -1;
+	 }
+
+  for( int i=0; i<json_object_array_length( owners ); i++ )
+	 {
+		json_object* pair = json_object_array_get_idx( owners, i );
+		if( !json_object_is_type( pair, json_type_array ) || json_object_array_length( pair ) != 2 )
+		  continue;
+
+		json_object* model = json_object_array_get_idx( pair, 0 );
+		json_object* owner = json_object_array_get_idx( pair, 1 );
+		if( !json_object_is_type( model, json_type_string ) ||
+			 !json_object_is_type( owner, json_type_string ) )
+		  continue;
+		(*fn)( av, json_object_get_string( model ), json_object_get_string( owner ) );
+	 }
+
+  json_object_put( job );
+  return 0;
+}
+
 int xdr_parse_pva( const char* buf, av_pva_t* pva )
 {
   json_object* job = json_tokener_parse( buf );  
   json_object* pva_array = json_object_object_get(job, "pva");
   unpack_json_pva( pva_array, pva );
+  json_object_put( job );
   return 0; // ok
 }
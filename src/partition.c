@@ -0,0 +1,266 @@
+/*
+  File: partition.c
+  Description: which member of the federation simulates each mirrored
+  model, and moving models between members by spatial locality
+  Version: $Id:$
+  License: LGPL v3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for strcmp()
+#include <math.h> // for fabs()
+#include <assert.h>
+
+#include "avon.h"
+#include "avon_internal.h"
+
+// XDR formatters, in json.c
+char* xdr_format_owners( av_t* );
+
+static const UT_icd _av_name_icd = { sizeof(const char*), NULL, NULL, NULL };
+
+//- OWNERSHIP ------------------------------------------------------
+
+static int name_index( const UT_array* names, const char* name )
+{
+	for( unsigned i=0; i<utarray_len(names); i++ )
+		if( *(const char**)utarray_eltptr( (UT_array*)names, i ) == name )
+			return i;
+	return -1;
+}
+
+/* record that [owner] simulates [model] and mirrors it into [mirror],
+	 from a member section of the federation file */
+void owners_add( av_t* av, const char* model, const char* owner, 
+								 const char* mirror, const char* prototype )
+{
+	model = intern( av, model );
+	_av_owner_t* own = NULL;
+	HASH_FIND_STR( av->owners, model, own );
+	if( own == NULL )
+		{
+			own = calloc( 1, sizeof(_av_owner_t) );
+			assert(own);
+			own->model = model;
+			own->prototype = intern( av, prototype );
+			utarray_new( own->mirrors, &_av_name_icd );
+			HASH_ADD_KEYPTR( hh, av->owners, own->model, strlen(own->model), own );
+		}
+	own->owner = intern( av, owner );
+
+	mirror = intern( av, mirror );
+	if( name_index( own->mirrors, mirror ) < 0 )
+		utarray_push_back( own->mirrors, &mirror );
+}
+
+_av_owner_t* owners_find( av_t* av, const char* model, size_t len )
+{
+	_av_owner_t* own = NULL;
+	HASH_FIND( hh, av->owners, model, len, own );
+	return own;
+}
+
+int owned_here( av_t* av, const _av_owner_t* own )
+{
+	return av->fed_name && strcmp( own->owner, av->fed_name ) == 0;
+}
+
+/* move [model] to [owner], on every member alike: the old owner now
+	 holds a puppet of it, and the new one the model itself. Returns -1
+	 if the model is not mirrored. */
+int partition_apply( av_t* av, const char* model, const char* owner )
+{
+	_av_owner_t* own = owners_find( av, model, strlen(model) );
+	if( own == NULL )
+		return -1;
+
+	owner = intern( av, owner );
+	if( own->owner == owner )
+		return 0;
+
+	const char* old = own->owner;
+	const int lost = owned_here( av, own );
+	own->owner = owner;
+	const int gained = owned_here( av, own );
+
+	const int i = name_index( own->mirrors, owner );
+	if( i >= 0 )
+		utarray_erase( own->mirrors, i, 1 );
+	if( name_index( own->mirrors, old ) < 0 )
+		utarray_push_back( own->mirrors, &old );
+
+	_av_node_t* node = NULL;
+	HASH_FIND_STR( av->tree, own->model, node );
+	if( node && ( lost || gained ) )
+		{
+			if( av->verbose )
+				printf( "[Avon] %s model %s\n", gained ? "gained" : "lost", own->model );
+
+			if( av->owner_set )
+				(*av->owner_set)( node->handle, gained );
+			else
+				printf( "[Avon] warning: model %s moved, but no owner callback is installed\n",
+								own->model );
+
+			// it is no longer a puppet, so stop extrapolating it
+			if( gained )
+				federation_dr_clear( av, node );
+		}
+
+	federation_exports( av, own );
+	return 0;
+}
+
+//- PARTITIONING ---------------------------------------------------
+
+static int by_x( const void* a, const void* b )
+{
+	const double d = ((const _av_placement_t*)a)->x - ((const _av_placement_t*)b)->x;
+	return d < 0 ? -1 : d > 0;
+}
+
+static int by_y( const void* a, const void* b )
+{
+	const double d = ((const _av_placement_t*)a)->y - ((const _av_placement_t*)b)->y;
+	return d < 0 ? -1 : d > 0;
+}
+
+static int by_name( const void* a, const void* b )
+{
+	return strcmp( *(const char* const*)a, *(const char* const*)b );
+}
+
+/* recursive bisection: split [items] across the longer side of their
+	 bounding box, in proportion to the [members] on each side, so that
+	 neighbours stay together and each member gets its share */
+static void bisect( _av_placement_t* items, uint32_t n, const char** members, uint32_t m )
+{
+	if( m == 1 || n == 0 )
+		{
+			for( uint32_t i=0; i<n; i++ )
+				items[i].proposed = members[0];
+			return;
+		}
+
+	double lo[2] = { items[0].x, items[0].y }, hi[2] = { items[0].x, items[0].y };
+	for( uint32_t i=1; i<n; i++ )
+		{
+			lo[0] = fmin( lo[0], items[i].x ); hi[0] = fmax( hi[0], items[i].x );
+			lo[1] = fmin( lo[1], items[i].y ); hi[1] = fmax( hi[1], items[i].y );
+		}
+	const int axis = hi[1] - lo[1] > hi[0] - lo[0];
+	qsort( items, n, sizeof(_av_placement_t), axis ? by_y : by_x );
+
+	const uint32_t m1 = m / 2;
+	const uint32_t k = (uint32_t)( (uint64_t)n * m1 / m );
+	if( k > 0 && k < n )
+		{
+			const double split = axis ? 
+				0.5 * ( items[k-1].y + items[k].y ) : 0.5 * ( items[k-1].x + items[k].x );
+			for( uint32_t i=0; i<n; i++ )
+				items[i].margin = fmin( items[i].margin, fabs( ( axis ? items[i].y : items[i].x ) - split ) );
+		}
+
+	bisect( items, k, members, m1 );
+	bisect( items + k, n - k, members + m1, m - m1 );
+}
+
+/* where each mirrored model we can see would be simulated, by the
+	 models' world positions at the last av_tick() */
+void partition_propose( av_t* av, _av_partition_t* part )
+{
+	memset( part, 0, sizeof(*part) );
+
+	part->members = malloc( ( HASH_COUNT( av->peers ) + 1 ) * sizeof(const char*) );
+	assert( part->members );
+	if( av->fed_name )
+		part->members[ part->member_count++ ] = intern( av, av->fed_name );
+	for( _av_peer_t* peer = av->peers; peer; peer = peer->hh.next )
+		part->members[ part->member_count++ ] = intern( av, peer->name );
+	// every member must propose the same, whatever its hash order
+	qsort( part->members, part->member_count, sizeof(const char*), by_name );
+
+	part->items = malloc( ( HASH_COUNT( av->owners ) + 1 ) * sizeof(_av_placement_t) );
+	assert( part->items );
+	for( _av_owner_t* own = av->owners; own; own = own->hh.next )
+		{
+			_av_node_t* node = NULL;
+			HASH_FIND_STR( av->tree, own->model, node );
+			if( node == NULL )
+				continue; // we have neither it nor a puppet of it, so leave it be
+
+			_av_placement_t* it = &part->items[ part->count++ ];
+			it->own = own;
+			it->x = node->world[0];
+			it->y = node->world[1];
+			it->margin = INFINITY;
+			it->proposed = own->owner;
+			it->migrate = 0;
+		}
+
+	if( part->member_count )
+		bisect( part->items, part->count, part->members, part->member_count );
+
+	for( uint32_t i=0; i<part->count; i++ )
+		{
+			_av_placement_t* it = &part->items[i];
+			it->migrate = it->proposed != it->own->owner && it->margin >= av->part_hysteresis;
+		}
+}
+
+void partition_free( _av_partition_t* part )
+{
+	free( part->items );
+	free( part->members );
+}
+
+int av_set_partitioning( av_t* av, double period, double hysteresis )
+{
+	assert(av);
+	if( period < 0 || hysteresis < 0 )
+		{
+			puts( "[Avon] error: partitioning period and hysteresis must not be negative" );
+			return -1;
+		}
+	av->part_period = period * 1e6;
+	av->part_hysteresis = hysteresis;
+	return 0;
+}
+
+/* every part_period, move the models that have strayed well into
+	 another member's region there, and tell the other members. The
+	 whole table is sent, so a member that missed one catches up. */
+void partition_tick( av_t* av )
+{
+	if( av->part_period == 0 || av->owners == NULL || av->fed_name == NULL )
+		return;
+
+	const uint64_t now = (*av->clock_get)( av->clock_get_user );
+	if( now - av->part_last < av->part_period )
+		return;
+	av->part_last = now;
+
+	_av_partition_t part;
+	partition_propose( av, &part );
+
+	for( uint32_t i=0; i<part.count; i++ )
+		if( part.items[i].migrate )
+			partition_apply( av, part.items[i].own->model, part.items[i].proposed );
+	partition_free( &part );
+
+	char* xdr = xdr_format_owners( av );
+	federation_broadcast( av, "/sim/owners", xdr );
+	free( xdr );
+}
+
+void partition_fini( av_t* av )
+{
+	_av_owner_t *own, *tmp;
+	HASH_ITER( hh, av->owners, own, tmp )
+		{
+			HASH_DEL( av->owners, own );
+			utarray_free( own->mirrors );
+			free( own );
+		}
+}
@@ -0,0 +1,186 @@
+/*
+  File: schedule.c
+  Description: pva sets held until a target simulation time, in a
+  time-ordered heap, so that remote control is applied on time
+  Version: $Id:$
+  License: LGPL v3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "avon.h"
+#include "avon_internal.h"
+
+static const UT_icd _av_scheduled_icd = { sizeof(_av_scheduled_t), NULL, NULL, NULL };
+
+// non-zero if [a] is due before [b]; equal times keep their arrival order
+static int earlier( const _av_scheduled_t* a, const _av_scheduled_t* b )
+{
+	return a->at < b->at || ( a->at == b->at && a->seq < b->seq );
+}
+
+static _av_scheduled_t* at( UT_array* heap, unsigned i )
+{
+	return (_av_scheduled_t*)utarray_eltptr( heap, i );
+}
+
+static void swap( UT_array* heap, unsigned i, unsigned j )
+{
+	_av_scheduled_t tmp = *at( heap, i );
+	*at( heap, i ) = *at( heap, j );
+	*at( heap, j ) = tmp;
+}
+
+static void sift_up( UT_array* heap, unsigned i )
+{
+	while( i > 0 && earlier( at( heap, i ), at( heap, (i-1)/2 ) ) )
+		{
+			swap( heap, i, (i-1)/2 );
+			i = (i-1)/2;
+		}
+}
+
+static void sift_down( UT_array* heap, unsigned i )
+{
+	const unsigned n = utarray_len( heap );
+	for(;;)
+		{
+			unsigned first = i;
+			const unsigned l = 2*i + 1, r = 2*i + 2;
+			if( l < n && earlier( at( heap, l ), at( heap, first ) ) )
+				first = l;
+			if( r < n && earlier( at( heap, r ), at( heap, first ) ) )
+				first = r;
+			if( first == i )
+				return;
+			swap( heap, i, first );
+			i = first;
+		}
+}
+
+static _av_pending_t* pending_of( av_t* av, uint32_t node )
+{
+	_av_pending_t* p = NULL;
+	HASH_FIND( hh, av->pending, &node, sizeof(node), p );
+	return p;
+}
+
+/* non-zero if [s] was scheduled for a node that has since been
+	 removed, even if its slot has been reused since */
+static int stale( av_t* av, const _av_scheduled_t* s )
+{
+	const _av_pending_t* p = pending_of( av, s->node );
+	return p == NULL || s->seq < p->first_seq;
+}
+
+// remove the heap's first entry
+static void pop( UT_array* heap )
+{
+	const unsigned n = utarray_len( heap );
+	if( n > 1 )
+		*at( heap, 0 ) = *at( heap, n-1 );
+	utarray_pop_back( heap );
+	if( n > 2 )
+		sift_down( heap, 0 );
+}
+
+/* hold [pva] for [node] until the first av_tick() at or after sim
+	 time [when]. Returns the number of sets now waiting. */
+uint32_t schedule_pva( av_t* av, _av_node_t* node, uint64_t when, 
+											 const av_pva_t* pva, int dr )
+{
+	if( av->scheduled == NULL )
+		utarray_new( av->scheduled, &_av_scheduled_icd );
+
+	_av_scheduled_t s;
+	s.at = when;
+	s.seq = av->scheduled_seq++;
+	s.node = node->index;
+	s.dr = dr;
+	s.pva = *pva;
+	utarray_push_back( av->scheduled, &s );
+	sift_up( av->scheduled, utarray_len( av->scheduled ) - 1 );
+
+	_av_pending_t* p = pending_of( av, node->index );
+	if( p == NULL )
+		{
+			p = malloc( sizeof(_av_pending_t) );
+			assert(p);
+			p->node = node->index;
+			p->count = 0;
+			p->first_seq = s.seq;
+			HASH_ADD( hh, av->pending, node, sizeof(p->node), p );
+		}
+	p->count++;
+	return utarray_len( av->scheduled ) - av->scheduled_stale;
+}
+
+// apply every set that is due by sim time [now], in time order
+void schedule_run( av_t* av, uint64_t now )
+{
+	if( av->scheduled == NULL )
+		return;
+
+	while( utarray_len( av->scheduled ) && at( av->scheduled, 0 )->at <= now )
+		{
+			const _av_scheduled_t s = *at( av->scheduled, 0 );
+			pop( av->scheduled );
+			if( stale( av, &s ) )
+				{
+					av->scheduled_stale--;
+					continue;
+				}
+			_av_pending_t* p = pending_of( av, s.node );
+			if( --p->count == 0 )
+				{
+					HASH_DEL( av->pending, p );
+					free( p );
+				}
+			pva_apply( av, _av_node_at( av, s.node ), &s.pva, s.dr );
+		}
+}
+
+/* forget the sets for [node], which is being removed, in constant
+	 time: they stay in the heap and are dropped when they come due */
+void schedule_remove( av_t* av, _av_node_t* node )
+{
+	_av_pending_t* p = pending_of( av, node->index );
+	if( p == NULL )
+		return;
+
+	av->scheduled_stale += p->count;
+	HASH_DEL( av->pending, p );
+	free( p );
+}
+
+uint64_t av_scheduled_next( av_t* av )
+{
+	assert(av);
+	if( av->scheduled == NULL )
+		return UINT64_MAX;
+
+	// don't wake the simulator for the sets of removed nodes
+	while( utarray_len( av->scheduled ) && stale( av, at( av->scheduled, 0 ) ) )
+		{
+			pop( av->scheduled );
+			av->scheduled_stale--;
+		}
+	if( utarray_len( av->scheduled ) == 0 )
+		return UINT64_MAX;
+	return at( av->scheduled, 0 )->at;
+}
+
+void schedule_fini( av_t* av )
+{
+	if( av->scheduled )
+		utarray_free( av->scheduled );
+
+	_av_pending_t *p, *tmp;
+	HASH_ITER( hh, av->pending, p, tmp )
+		{
+			HASH_DEL( av->pending, p );
+			free( p );
+		}
+}
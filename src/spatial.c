@@ -0,0 +1,370 @@
+/*
+  File: spatial.c
+  Description: world frame poses of the model tree, and a uniform grid 
+  index over them for region queries
+  Version: $Id:$  
+  License: LGPL v3.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // for memcpy()
+#include <math.h> // for floor(), sin(), cos(), atan2(), asin()
+#include <assert.h>
+
+#include "avon.h"
+#include "avon_internal.h"
+
+// grid coordinate of a position along one axis
+static int32_t cell_coord( const struct av* av, double v )
+{
+	return (int32_t)floor( v / av->cell_size );
+}
+
+static int64_t cell_key( int32_t ix, int32_t iy )
+{
+	return (int64_t)(((uint64_t)(uint32_t)ix << 32) | (uint32_t)iy);
+}
+
+// move the last member of [cell] into [slot] and shrink the array
+static void cell_remove( struct av* av, _av_cell_t* cell, uint32_t slot )
+{
+	UT_array* m = cell->members;
+	uint32_t last = *(uint32_t*)utarray_back( m );
+	*(uint32_t*)utarray_eltptr( m, slot ) = last;
+	av->cell_refs[last].slot = slot;
+	utarray_pop_back( m );
+
+	// free empty cells so that whole-grid scans stay proportional to
+	// the occupied area
+	if( utarray_len( m ) == 0 )
+		{
+			HASH_DEL( av->cells, cell );
+			utarray_free( cell->members );
+			free( cell );
+		}
+}
+
+/** Insert [node] in the grid at its current pose, or move it if it
+		has changed cells since the last update. */
+void spatial_update( struct av* av, _av_node_t* node )
+{
+	// a model may have grown without moving cells
+	if( node->radius > av->max_radius )
+		av->max_radius = node->radius;
+
+	// the side table covers every node in the pool
+	if( av->cell_refs_cap < av->node_count )
+		{
+			const uint32_t cap = av->node_block_count << AV_NODE_BLOCK_BITS;
+			av->cell_refs = realloc( av->cell_refs, cap * sizeof(_av_cell_ref_t) );
+			assert( av->cell_refs );
+			memset( av->cell_refs + av->cell_refs_cap, 0, 
+							(cap - av->cell_refs_cap) * sizeof(_av_cell_ref_t) );
+			av->cell_refs_cap = cap;
+		}
+	_av_cell_ref_t* ref = &av->cell_refs[ node->index ];
+
+	const int64_t key = cell_key( cell_coord( av, node->world[0] ), 
+																cell_coord( av, node->world[1] ) );
+	
+	if( ref->cell && ref->cell->key == key )
+		return; // still in the same cell - the common case
+	
+	if( ref->cell )
+		cell_remove( av, ref->cell, ref->slot );
+	
+	_av_cell_t* cell = NULL;
+	HASH_FIND( hh, av->cells, &key, sizeof(key), cell );
+	if( cell == NULL )
+		{
+			cell = malloc( sizeof(_av_cell_t) );
+			assert(cell);
+			cell->key = key;
+			utarray_new( cell->members, &_av_index_icd );
+			HASH_ADD( hh, av->cells, key, sizeof(key), cell );
+		}
+	
+	ref->cell = cell;
+	ref->slot = utarray_len( cell->members );
+	utarray_push_back( cell->members, &node->index );
+}
+
+void spatial_remove( struct av* av, _av_node_t* node )
+{
+	if( node->index >= av->cell_refs_cap )
+		return; // never indexed
+
+	_av_cell_ref_t* ref = &av->cell_refs[ node->index ];
+	if( ref->cell )
+		cell_remove( av, ref->cell, ref->slot );
+	ref->cell = NULL;
+}
+
+// append the members of [cell] whose bounding circles overlap the box
+static void cell_query( struct av* av, const _av_cell_t* cell,
+												double x0, double y0, double x1, double y1, 
+												UT_array* found )
+{
+	uint32_t* i = NULL;
+	while( (i = (uint32_t*)utarray_next( cell->members, i )) )
+		{
+			const _av_node_t* node = _av_node_at( av, *i );
+			const double x = node->world[0], y = node->world[1];
+			
+			// distance from the box to the model's center
+			const double dx = x < x0 ? x0 - x : ( x > x1 ? x - x1 : 0 );
+			const double dy = y < y0 ? y0 - y : ( y > y1 ? y - y1 : 0 );
+			
+			if( dx*dx + dy*dy <= node->radius * node->radius )
+				utarray_push_back( found, i );
+		}
+}
+
+/** Append to [found] the indices of the models whose extents overlap
+		the box [x0,x1] x [y0,y1]. */
+void spatial_query( struct av* av, 
+										double x0, double y0, double x1, double y1, 
+										UT_array* found )
+{
+	assert( x0 <= x1 && y0 <= y1 );
+
+	// a model in a cell outside the box may still reach into it
+	const double r = av->max_radius;
+	const int32_t ix0 = cell_coord( av, x0 - r ), ix1 = cell_coord( av, x1 + r );
+	const int32_t iy0 = cell_coord( av, y0 - r ), iy1 = cell_coord( av, y1 + r );
+	
+	// visit whichever is fewer: the cells under the box, or the
+	// occupied cells
+	const double span = ((double)ix1 - ix0 + 1) * ((double)iy1 - iy0 + 1);
+	
+	if( span > HASH_COUNT( av->cells ) )
+		{
+			_av_cell_t* cell;
+			for( cell = av->cells; cell; cell = cell->hh.next )
+				cell_query( av, cell, x0, y0, x1, y1, found );
+			return;
+		}
+
+	for( int32_t ix = ix0; ix <= ix1; ix++ )
+		for( int32_t iy = iy0; iy <= iy1; iy++ )
+			{
+				const int64_t key = cell_key( ix, iy );
+				_av_cell_t* cell = NULL;
+				HASH_FIND( hh, av->cells, &key, sizeof(key), cell );
+				if( cell )
+					cell_query( av, cell, x0, y0, x1, y1, found );
+			}
+}
+
+/** Append to [found] the indices of the models whose extents come
+		within [r] of ([x],[y]). */
+void spatial_query_near( struct av* av, 
+												 double x, double y, double r,
+												 UT_array* found )
+{
+	const unsigned start = utarray_len( found );
+	spatial_query( av, x-r, y-r, x+r, y+r, found );
+	
+	// the box query returns the corners too: keep only the disk,
+	// compacting in place
+	unsigned keep = start;
+	for( unsigned i = start; i < utarray_len( found ); i++ )
+		{
+			uint32_t index = *(uint32_t*)utarray_eltptr( found, i );
+			const _av_node_t* node = _av_node_at( av, index );
+			const double dx = node->world[0] - x, dy = node->world[1] - y;
+			const double reach = r + node->radius;
+			
+			if( dx*dx + dy*dy <= reach * reach )
+				{
+					*(uint32_t*)utarray_eltptr( found, keep ) = index;
+					keep++; // not in the macro argument, which is evaluated twice
+				}
+		}
+	utarray_resize( found, keep );
+}
+
+// world frame poses ----------------------------------------------------
+
+// rotation matrix of roll, pitch and yaw (a), as R = Rz(a) Ry(p) Rx(r)
+static void rpy_to_matrix( const double rpy[3], double m[9] )
+{
+	const double cr = cos(rpy[0]), sr = sin(rpy[0]);
+	const double cp = cos(rpy[1]), sp = sin(rpy[1]);
+	const double ca = cos(rpy[2]), sa = sin(rpy[2]);
+	
+	m[0] = ca*cp; m[1] = ca*sp*sr - sa*cr; m[2] = ca*sp*cr + sa*sr;
+	m[3] = sa*cp; m[4] = sa*sp*sr + ca*cr; m[5] = sa*sp*cr - ca*sr;
+	m[6] = -sp;   m[7] = cp*sr;            m[8] = cp*cr;
+}
+
+static void matrix_to_rpy( const double m[9], double rpy[3] )
+{
+	const double s = m[6] > 1.0 ? 1.0 : ( m[6] < -1.0 ? -1.0 : m[6] );
+	rpy[1] = -asin( s );
+
+	// pitched straight up or down, only the sum or difference of roll
+	// and yaw is defined, so put it all in the yaw. Child poses are
+	// composed from these angles, so they must describe it exactly.
+	if( hypot( m[7], m[8] ) < 1e-9 )
+		{
+			rpy[0] = 0;
+			rpy[2] = atan2( -m[1], m[4] );
+			return;
+		}
+	rpy[0] = atan2( m[7], m[8] );
+	rpy[2] = atan2( m[3], m[0] );
+}
+
+/* compose a child's [local] pose with its parent's world pose, given
+	 as position [pw] and rotation matrix [rw], into [world] and [rot] */
+static void pose_compose( const double pw[3], const double rw[9], 
+													const double local[6],
+													double world[6], double rot[9] )
+{
+	double rl[9];
+	rpy_to_matrix( local+3, rl );
+	
+	for( int i=0; i<3; i++ )
+		{
+			const double* r = rw + 3*i;
+			world[i] = pw[i] + r[0]*local[0] + r[1]*local[1] + r[2]*local[2];
+			
+			for( int j=0; j<3; j++ )
+				rot[3*i+j] = r[0]*rl[j] + r[1]*rl[3+j] + r[2]*rl[6+j];
+		}
+	
+	matrix_to_rpy( rot, world+3 );
+}
+
+// list the nodes breadth first, which puts every parent before its
+// children
+static void build_order( struct av* av )
+{
+	if( av->order == NULL )
+		utarray_new( av->order, &_av_index_icd );
+	utarray_clear( av->order );
+	
+	utarray_push_back( av->order, &av->root->index );
+	for( unsigned i=0; i < utarray_len( av->order ); i++ )
+		{
+			const _av_node_t* node = 
+				_av_node_at( av, *(uint32_t*)utarray_eltptr( av->order, i ) );
+			
+			uint32_t* c = NULL;
+			while( node->children && (c = (uint32_t*)utarray_next( node->children, c )) )
+				utarray_push_back( av->order, c );
+		}
+	
+	av->order_dirty = 0;
+}
+
+/** Update the world poses of every model whose own pose or an
+		ancestor's pose changed at this tick, in one pass over the tree in
+		topological order, and move them in the spatial index. Unchanged
+		subtrees are skipped. */
+void spatial_world_poses( struct av* av )
+{
+	if( av->order == NULL || av->order_dirty )
+		build_order( av );
+	
+	_av_node_t* root = av->root;
+	root->world_changed = 0;
+	
+	const uint32_t* order = (uint32_t*)utarray_front( av->order );
+	const unsigned count = utarray_len( av->order );
+	
+	// siblings are adjacent in the order, so each parent's rotation is
+	// built once rather than stored in every node
+	uint32_t rot_of = AV_NODE_FREE;
+	double rw[9], rot[9];
+
+	for( unsigned i=1; i<count; i++ ) // skip the root
+		{
+			_av_node_t* node = _av_node_at( av, order[i] );
+			const _av_node_t* parent = _av_node_at( av, node->parent );
+
+			node->world_changed = node->pose_changed || parent->world_changed;
+			node->pose_changed = 0;
+			
+			if( ! node->world_changed )
+				continue;
+			
+			if( parent == root ) // already in the world frame
+				memcpy( node->world, node->pose, sizeof(node->world) );
+			else
+				{
+					if( rot_of != node->parent )
+						{
+							rpy_to_matrix( parent->world+3, rw );
+							rot_of = node->parent;
+						}
+					pose_compose( parent->world, rw, node->pose, node->world, rot );
+				}
+			
+			spatial_update( av, node );
+		}
+}
+
+/* the transform from the CS of a sensor mounted at [pose] on [node]
+	 into the node's CS, or into the world CS if [world] is non-zero */
+void spatial_sensor_frame( const _av_node_t* node, const double pose[6], 
+													 int world, double origin[3], double rot[9] )
+{
+	if( world )
+		{
+			double p[6], rw[9];
+			rpy_to_matrix( node->world+3, rw );
+			pose_compose( node->world, rw, pose, p, rot );
+			memcpy( origin, p, 3*sizeof(double) );
+		}
+	else
+		{
+			rpy_to_matrix( pose+3, rot );
+			memcpy( origin, pose, 3*sizeof(double) );
+		}
+}
+
+/* the beam cache of [sensor]'s ranger [transducer], with room for
+	 [count] beams. New entries have NaN angles, so they never match a
+	 sample and are filled on first use. */
+_av_beam_t* spatial_beams( _av_sensor_t* sensor, uint32_t transducer, 
+													 uint32_t count )
+{
+	if( transducer >= sensor->beams_count )
+		{
+			const uint32_t n = transducer + 1;
+			sensor->beams = realloc( sensor->beams, n * sizeof(_av_beams_t) );
+			assert( sensor->beams );
+			memset( sensor->beams + sensor->beams_count, 0, 
+							(n - sensor->beams_count) * sizeof(_av_beams_t) );
+			sensor->beams_count = n;
+		}
+	
+	_av_beams_t* b = &sensor->beams[transducer];
+	if( count > b->cap )
+		{
+			b->beam = realloc( b->beam, count * sizeof(_av_beam_t) );
+			assert( b->beam );
+			for( uint32_t i=b->cap; i<count; i++ )
+				b->beam[i].bearing = b->beam[i].azimuth = NAN;
+			b->cap = count;
+		}
+	return b->beam;
+}
+
+void spatial_fini( struct av* av )
+{
+	if( av->order )
+		utarray_free( av->order );
+	free( av->cell_refs );
+
+	_av_cell_t *cell, *tmp;
+	HASH_ITER( hh, av->cells, cell, tmp )
+		{
+			HASH_DEL( av->cells, cell );
+			utarray_free( cell->members );
+			free( cell );
+		}
+}